@@ -13,12 +13,7 @@
 
 #define RF69_COMPAT 0 // define this to use the RF69 driver i.s.o. RF12
 
-#include <JeeLib.h>
-#include <util/crc16.h>
-#include <avr/eeprom.h>
-#include <avr/pgmspace.h>
-#include <util/parity.h>
-
+#include "hal.h"
 #include "firefly.h"
 
 #define MAJOR_VERSION RF12_EEPROM_VERSION // bump when EEPROM layout changes
@@ -38,6 +33,10 @@
 #define LED_PIN     9       // activity LED, comment out to disable
 #endif
 
+#ifdef LED_BAM
+#undef  LED_PIN             // D9 is a BAM channel, see bam.h
+#endif
+
 /// Save a few bytes of flash by declaring const if used more than once.
 const char INVALID1[] PROGMEM = "\rInvalid\n";
 const char INITFAIL[] PROGMEM = "config save failed\n";
@@ -114,10 +113,12 @@ static byte inChar () {
 
 #endif
 
+#if DATAFLASH
 static unsigned long now () {
     // FIXME 49-day overflow
-    return millis() / 1000;
+    return hal_millis() / 1000;
 }
+#endif
 
 static void activityLed (byte on) {
 #ifdef LED_PIN
@@ -290,8 +291,8 @@ static void kakuSend(char addr, byte device, byte on) {
 #define df_present() 0
 #define df_initialize()
 #define df_dump()
-#define df_replay(x,y)
-#define df_erase(x)
+#define df_replay(x,y) ((void) (x), (void) (y))
+#define df_erase(x) ((void) (x))
 #define df_wipe()
 #define df_append(x,y)
 
@@ -317,6 +318,10 @@ const char helpText1[] PROGMEM =
     "Remote control commands:\n"
     "  <hchi>,<hclo>,<addr>,<cmd> f     - FS20 command (868 MHz)\n"
     "  <addr>,<dev>,<on> k              - KAKU command (433 MHz)\n"
+    "Wirefly commands:\n"
+    "  <n> p      - select pattern <n> and tell the network\n"
+    "  <n> h      - loop timing histograms (1 = and clear them)\n"
+    "  <ms> u     - listen <ms> per 1024 ms to save power (0 = always)\n"
 ;
 
 const char helpText2[] PROGMEM =
@@ -371,7 +376,7 @@ static void handleInput (char c) {
         rf12_initialize(stack[2], bandToFreq(stack[0]), stack[1],
                             config.frequency_offset);
         rf12_sendNow(stack[3], stack + 4, top - 4);
-        rf12_sendWait(2);
+        hal_radioSendWait(2);
         rf12_configSilent();
     } else if (c > ' ') {
         switch (c) {
@@ -527,8 +532,16 @@ static void handleInput (char c) {
             break;
 
         case 'p': // select a new pattern
-            //immediately change pattern:
-            pattern_set(value);
+            //immediately change pattern, and tell the network:
+            wirefly_command(value);
+            break;
+
+        case 'h': // loop timing histograms, 1 = and start over
+            stats_dump(value == 1);
+            break;
+
+        case 'u': // radio listen window, ms per 1024 ms, 0 = always listen
+            wirefly_listen(value);
             break;
 
         default:
@@ -593,10 +606,10 @@ void rf12_loop () {
     if (Serial.available())
         handleInput(Serial.read());
 #endif
-    if (rf12_recvDone()) {
+    if (hal_radioRecvDone()) {
 #ifdef SERIAL_DEBUG
-        byte n = rf12_len;
-        if (rf12_crc == 0)
+        byte n = hal_radioLen;
+        if (hal_radioCrc == 0)
             showString(PSTR("OK"));
         else {
             if (config.quiet_mode)
@@ -609,14 +622,14 @@ void rf12_loop () {
             printOneChar('X');
         if (config.group == 0) {
             showString(PSTR(" G"));
-            showByte(rf12_grp);
+            showByte(hal_radioGrp);
         }
         printOneChar(' ');
-        showByte(rf12_hdr);
+        showByte(hal_radioHdr);
         for (byte i = 0; i < n; ++i) {
             if (!config.hex_output)
                 printOneChar(' ');
-            showByte(rf12_data[i]);
+            showByte(hal_radioData[i]);
         }
 #if RF69_COMPAT
         // display RSSI value after packet data
@@ -634,29 +647,29 @@ void rf12_loop () {
             if (config.group == 0) {
                 showString(PSTR(" II "));
             }
-            printOneChar(rf12_hdr & RF12_HDR_DST ? '>' : '<');
-            printOneChar('@' + (rf12_hdr & RF12_HDR_MASK));
-            displayASCII((const byte*) rf12_data, n);
+            printOneChar(hal_radioHdr & RF12_HDR_DST ? '>' : '<');
+            printOneChar('@' + (hal_radioHdr & RF12_HDR_MASK));
+            displayASCII((const byte*) hal_radioData, n);
         }
 #endif
 
-        if (rf12_crc == 0) {
+        if (hal_radioCrc == 0) {
             activityLed(1);
 
             if (df_present())
-                df_append((const char*) rf12_data - 2, rf12_len + 2);
+                df_append((const char*) hal_radioData - 2, hal_radioLen + 2);
 
             if (RF12_WANTS_ACK && (config.collect_mode) == 0) {
 #ifdef SERIAL_DEBUG
                 showString(PSTR(" -> ack\n"));
 #endif
-                rf12_sendStart(RF12_ACK_REPLY, 0, 0);
+                hal_radioSend(RF12_ACK_REPLY, 0, 0);
             }
             activityLed(0);
         }
     }
 
-    if (cmd && rf12_canSend()) {
+    if (cmd && hal_radioCanSend()) {
         activityLed(1);
 
         showString(PSTR(" -> "));
@@ -665,7 +678,7 @@ void rf12_loop () {
         byte header = cmd == 'a' ? RF12_HDR_ACK : 0;
         if (dest)
             header |= RF12_HDR_DST | dest;
-        rf12_sendStart(header, stack, sendLen);
+        hal_radioSend(header, stack, sendLen);
         cmd = 0;
 
         activityLed(0);
@@ -0,0 +1,60 @@
+#include "hal.h"
+#include "firefly.h"
+
+#ifdef LED_BAM
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Bit angle modulation, see bam.h
+
+static const bam_pin bam_pins[BAM_CHANNELS] = BAM_PINS;
+
+// clock select and length of each plane
+typedef struct {
+	byte select;
+	word count;
+} bam_timing;
+
+#define BAM_TIMING(b)  { bam_select(BAM_REFRESH_HZ, b), bam_count(BAM_REFRESH_HZ, b) }
+
+static const bam_timing bam_timings[8] PROGMEM = {
+	BAM_TIMING(0), BAM_TIMING(1), BAM_TIMING(2), BAM_TIMING(3),
+	BAM_TIMING(4), BAM_TIMING(5), BAM_TIMING(6), BAM_TIMING(7),
+};
+
+static volatile byte bam_planes[8][BAM_PORTS];
+static byte bam_masks[BAM_PORTS];  // pins of each port that are ours
+static byte bam_plane;             // the plane to show next
+
+// the plane timer: show the next plane for as long as its bit is worth
+static void bam_next()
+{
+	byte b = bam_plane;
+	for (byte i = 0; i < BAM_PORTS; ++i)
+		hal_portWrite(i, bam_masks[i], bam_planes[b][i]);
+	hal_planeNext(pgm_read_byte(&bam_timings[b].select),
+		pgm_read_word(&bam_timings[b].count));
+	bam_plane = (b + 1) & 7;
+}
+
+// all channels dark (255) and the plane timer running
+void bam_begin()
+{
+	for (byte ch = 0; ch < BAM_CHANNELS; ++ch) {
+		bam_masks[bam_pins[ch].port] |= 1 << bam_pins[ch].bit;
+		bam_setPlanes(bam_planes, bam_pins[ch], 255);
+	}
+	for (byte i = 0; i < BAM_PORTS; ++i)
+		hal_portMode(i, bam_masks[i]);
+	hal_planeBegin(bam_next);
+}
+
+// set channel ch to value from the next plane on; a refresh under way may
+// show a mix of the old and new value, for one refresh
+void bam_write(byte ch, byte value)
+{
+	if (ch < BAM_CHANNELS)
+		bam_setPlanes(bam_planes, bam_pins[ch], value);
+}
+
+#endif
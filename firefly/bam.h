@@ -0,0 +1,96 @@
+#ifndef __WIREFLY_BAM_H
+#define __WIREFLY_BAM_H
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Bit angle modulation
+// With LED_BAM on, the fade engine drives BAM_CHANNELS outputs, one RGB
+// firefly per three, on plain port pins instead of the three hardware PWM
+// pins. A refresh is 8 planes, plane b showing bit b of every channel for
+// 2^b / 255 of the refresh. bam_write() only flips the channel's bit in
+// the 8 planes; the plane timer (timer 2, see hal_avr.cpp) writes a whole
+// plane to the ports at once. So the interrupt costs the same however many
+// channels there are, 8 of them per refresh, and its share of the CPU is
+// bounded by BAM_REFRESH_HZ alone. host/wirefly_bam works the share out
+// for other rates and channel counts.
+//
+// A value is the pin's duty cycle, as for hal_pwmWrite(): with common-anode
+// LEDs 255 is dark. The default map below takes 12 pins: DIO, AIO and,
+// between them, IRQ, D8, D9 and A4 for four fireflies, one on each port. D9
+// is the activity LED otherwise; RF12.h drops LED_PIN when LED_BAM is on.
+// Up to BAM_CHANNELS_MAX fit in the planes; beyond 13 the JeeNode runs out
+// of free pins.
+
+#define BAM_REFRESH_HZ     200  // refreshes a second; plane 0 is 1/255 of one
+#define BAM_CHANNELS_MAX   24
+#define BAM_PORTS          3    // B, C, D
+
+// a channel's pin: its port, 0 = B, 1 = C, 2 = D, and bit
+typedef struct {
+	byte port;
+	byte bit;
+} bam_pin;
+
+#define BAM_PB(bit)  { 0, bit }
+#define BAM_PC(bit)  { 1, bit }
+#define BAM_PD(bit)  { 2, bit }
+
+// red, green, blue of each firefly
+#define BAM_PINS { \
+	BAM_PD(4), BAM_PC(0), BAM_PD(3),  /* port 1: DIO, AIO, IRQ */ \
+	BAM_PD(5), BAM_PC(1), BAM_PB(0),  /* port 2: DIO, AIO, D8 */ \
+	BAM_PD(6), BAM_PC(2), BAM_PB(1),  /* port 3: DIO, AIO, D9 */ \
+	BAM_PD(7), BAM_PC(3), BAM_PC(4),  /* port 4: DIO, AIO, A4 */ \
+}
+#define BAM_CHANNELS  12
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Plane timing, worked out by the compiler
+// Each plane gets the fastest timer 2 clock that can count its length in 8
+// bits. Clock selects 1 to 7 divide F_CPU by 1, 8, 32, 64, 128, 256, 1024.
+
+static constexpr unsigned long bam_prescale(byte select)
+{
+	return select <= 1 ? 1 : select == 2 ? 8 : select == 3 ? 32 : select == 4 ? 64 :
+		select == 5 ? 128 : select == 6 ? 256 : 1024;
+}
+
+// cpu cycles plane b lasts at hz refreshes a second
+static constexpr unsigned long bam_cycles(unsigned long hz, byte b)
+{
+	return ((F_CPU / hz) << b) / 255;
+}
+
+static constexpr byte bam_select(unsigned long hz, byte b, byte select = 1)
+{
+	return select < 7 && bam_cycles(hz, b) > 256 * bam_prescale(select) ?
+		bam_select(hz, b, select + 1) : select;
+}
+
+static constexpr word bam_clamp(unsigned long counts)
+{
+	return counts < 1 ? 1 : counts > 256 ? 256 : counts;
+}
+
+// timer counts plane b lasts, 1 to 256
+static constexpr word bam_count(unsigned long hz, byte b)
+{
+	return bam_clamp((bam_cycles(hz, b) + bam_prescale(bam_select(hz, b)) / 2) /
+		bam_prescale(bam_select(hz, b)));
+}
+
+// set or clear the bits of value for the channel on port, bit in the planes
+static inline void bam_setPlanes(volatile byte planes[8][BAM_PORTS], bam_pin pin, byte value)
+{
+	byte mask = 1 << pin.bit;
+	for (byte b = 0; b < 8; ++b, value >>= 1)
+		if (value & 1)
+			planes[b][pin.port] |= mask;
+		else
+			planes[b][pin.port] &= ~mask;
+}
+
+void bam_begin();
+void bam_write(byte ch, byte value);
+
+#endif
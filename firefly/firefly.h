@@ -1,42 +1,53 @@
 #ifndef __FIREFLY_H
 #define __FIREFLY_H
 
+#include "hal.h"
+
 #define WIREFLY_VERSION "[Wirefly 08-2017]"
 // comment out below before compiling production codez!
 #define SERIAL_DEBUG 1
+// loop() phase timing for the 'h' command; comment out to save the RAM
+#define LOOP_STATS 1
+
+#include "trace.h"
+#include "stats.h"
+#include "bam.h"
+#include "strip.h"
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // RF12 configuration setup code
 #define RF12_BUFFER_SIZE	66
-static uint8_t wirefly_msg_data[RF12_BUFFER_SIZE];
-static byte wirefly_msg_stack[RF12_MAXDATA+4], wirefly_msg_top, wirefly_msg_sendLen, wirefly_msg_dest;
-// cmd may be set to: [0, 'a', 'c']
-// 0   no command
-// 'a' send request ack
-// 'c' send
-static char wirefly_msg_cmd;
 
 #define COLLECT 0x20 // collect mode, i.e. pass incoming without sending acks
 
 // http://jeelabs.net/pub/docs/jeelib/classSleepy.html
-// WDT inturrupt handler, required to use Sleepy::loseSomeTime()
-//ISR(WDT_vect) { Sleepy::watchdogEvent(); }
+// The WDT interrupt handler Sleepy::loseSomeTime() needs, for hal_powerDown(),
+// is in firefly.ino: it may only be defined once.
 
 // Select at features:
 //#define LUXMETER 10
 //#define RTCTIMER 11
 //#define LED_MONO 100
 #define LED_RGB 101
-//#define LED_ADDR 102
+//#define LED_ADDR 102    // an addressable strip, RGB_STRIP or RGB_NEOPIX, see strip.h
+//#define LED_BAM 103     // many RGB fireflies on port pins, see bam.h
 //#define RGB_STRIP 200
 //#define RGB_NEOPIX 201
 #define LED_SUPERFLUX 202
 
 // For PATTERN_FADER and rgbSet(): 
 // Used to adjust the limits for the LED, especially if it has a lower ON threshold
-#define  MIN_RGB_VALUE  10   // no brighter than 10. TODO add gamma correction 
+#define  MIN_RGB_VALUE  10   // no brighter than 10
 #define  MAX_RGB_VALUE  255  // no darker than 255. (darkest)
+// rgbSet() fits each channel into its own window, for LEDs that differ in
+// brightness or switch on late; 255 is still fully off
+#define  RED_MIN_VALUE    MIN_RGB_VALUE
+#define  RED_MAX_VALUE    MAX_RGB_VALUE
+#define  GREEN_MIN_VALUE  MIN_RGB_VALUE
+#define  GREEN_MAX_VALUE  MAX_RGB_VALUE
+#define  BLUE_MIN_VALUE   MIN_RGB_VALUE
+#define  BLUE_MAX_VALUE   MAX_RGB_VALUE
 
 #ifdef LED_MONO
   #define LEDPIN 5
@@ -45,7 +56,13 @@ static char wirefly_msg_cmd;
   #define REDPIN 5        // DIO2
   #define GREENPIN 6      // DIO3
   #define BLUEPIN 3   // IRQ2
-  //#define BLUEPIN 9   // SEL1 LedNode
+  //#define BLUEPIN 9   // SEL1 LedNode, needs timer 1 back from the tick
+#endif
+
+// the tick has timer 1 (hal_avr.cpp), so pins 9 and 10 have no PWM
+#if defined(__AVR__) && (LEDPIN == 9 || LEDPIN == 10 || REDPIN == 9 || REDPIN == 10 || \
+	GREENPIN == 9 || GREENPIN == 10 || BLUEPIN == 9 || BLUEPIN == 10)
+#error "pins 9 and 10 lost their PWM to the tick's timer 1"
 #endif
 
 #ifdef LUXMETER
@@ -56,8 +73,46 @@ LuxPlug sensor (myBus, 0x39);
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // Network messages
-#define WIREFLY_SEND_PATTERN    2
-#define WIREFLY_SEND_CLOCKSYNC  10
+// A frame is [WIREFLY_MSG_VERSION, records...], each record [type << 4 | length, value...]
+// (length 15: [type << 4 | 15, length, value...]). Record types are 1..15.
+// Receivers skip record types they don't know; a new frame layout gets a new version.
+#define WIREFLY_MSG_VERSION     0x81  // high bit set, unlike the old single-message frames
+
+#define WIREFLY_SEND_PATTERN    2   // [pattern, epoch hi, epoch lo, originator]
+#define WIREFLY_SEND_TIME       3   // [time ref, network time (4 bytes, msb first)]
+#define WIREFLY_SEND_CLOCKSYNC  10  // [phase hi, phase lo], ms into the sender's cycle
+
+// transmit priorities, most urgent first; ACKs go ahead of all of them
+#define WIREFLY_PRIO_SYNC       0   // clock sync pings
+#define WIREFLY_PRIO_PATTERN    1   // pattern and network time broadcasts
+#define WIREFLY_PRIO_TELEMETRY  2   // anything that can wait
+
+typedef struct
+{
+	const byte* next;  // the next record
+	const byte* end;   // the end of the frame
+} wirefly_msgReader;
+
+byte* wirefly_msgAdd(byte type, byte len);
+const byte* wirefly_msgFrame(byte* len);
+byte* wirefly_msgQueue(byte type, byte prio, byte len);
+byte* wirefly_msgFind(byte type);
+boolean wirefly_msgCancel(byte type);
+void wirefly_msgAck(byte hdr);
+boolean wirefly_msgPending();
+boolean wirefly_msgTakeAck(byte* hdr);
+word wirefly_msgTake();
+boolean wirefly_msgBegin(wirefly_msgReader* r, const volatile byte* data, byte len);
+byte wirefly_msgNext(wirefly_msgReader* r, const byte** value, byte* len);
+
+// handles one received record: the sender's node id and the record's value
+typedef void (*wirefly_handler)(byte sender, const byte* value, byte len);
+
+boolean wirefly_rxPush(byte hdr, const volatile byte* data, byte len);
+word wirefly_rxDrops();
+unsigned long wirefly_rxTime();
+void wirefly_subscribe(byte type, wirefly_handler fn);
+byte wirefly_dispatch();
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
@@ -78,10 +133,27 @@ LuxPlug sensor (myBus, 0x39);
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 int wirefly_send();
 int wirefly_interrupt();
-boolean wirefly_delay(unsigned long wait_time);
+int wirefly_recvDone();
+void wirefly_command(int value);
+unsigned long network_millis();
+
+// where the time went since power up, see "Power" in firefly.ino
+typedef struct {
+	unsigned long wakeups;   // returns from sleep, idle or powered down
+	unsigned long awakeUs;   // running, by hal_micros()
+	unsigned long sleepMs;   // powered down, MCU and radio off
+	unsigned long listenMs;  // radio receiver on
+} wirefly_power;
+
+void wirefly_listen(word window);
+const wirefly_power* wirefly_powerCounters();
+word wirefly_random(word n);
+word wirefly_randomRange(word lo, word hi);
+void pattern_begin();
 void pattern_run();
-void pattern_off();
+void pattern_off(unsigned long now);
 void pattern_set(int value);
+void pattern_clockSyncStamp(byte* value);
 int pattern_get();
 
 #endif
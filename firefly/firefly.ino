@@ -1,7 +1,7 @@
-#include <Ports.h>
-#include <JeeLib.h>
+#include "hal.h"
 #include "RF12.h"
 #include "firefly.h"
+#include <WireflyRandom.h>
 
 /*                 JeeNode / JeeNode USB / JeeSMD
  -------|-----------------------|----|-----------------------|----
@@ -18,11 +18,390 @@
  -------|-----------------------|----|-----------------------|----
 */
 
-static boolean wirefly_needToSend;
-static MilliTimer wirefly_sendTimer; //broadcast the pattern on this interval
-static int WIREFLY_TIMER_BROADCAST = 4096;
-static MilliTimer pattern_immuneTimer; //stop listening after pattern change
-static int WIREFLY_TIMER_IMMUNE = 16384;
+
+#ifdef HAL_AVR
+// WDT interrupt handler, required to use Sleepy::loseSomeTime()
+ISR(WDT_vect) { Sleepy::watchdogEvent(); }
+#endif
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Network time
+// network_millis() is this node's estimate of the reference node's millis(),
+// so patterns can render from a clock shared by the whole network.
+// The reference is the lowest node id around. Every pattern broadcast carries
+// the sender's reference and network time: a node adopts any lower reference
+// it hears, and otherwise pulls its time half way towards that of nodes that
+// follow the same reference, learning the drift of its crystal as it goes.
+
+#define NETTIME_LATENCY    4     // ms from the sender reading its clock to our receiving it
+#define NETTIME_STEP       250   // ms, larger errors are corrected in one jump
+#define NETTIME_MAX_DRIFT  1049  // 1000 ppm, in the 2^-20 units of nettime_drift
+
+static byte nettime_ref;            // node id we take our time from, 0 = none heard yet
+static long nettime_offset;         // network time - millis(), at nettime_local
+static long nettime_drift;          // network ms gained per local ms, times 2^20
+static unsigned long nettime_local; // millis() of the last correction
+static byte nettime_jumps;          // jumps so far, wrapping
+static long nettime_jump;           // network ms the last one moved us by
+
+unsigned long network_millis() {
+	unsigned long now = hal_millis();
+	long elapsed = now - nettime_local;
+	return now + nettime_offset + (long) (((long long) elapsed * nettime_drift) >> 20);
+}
+
+// the node id our network time follows: the lowest heard, or our own if lower
+// (looked up every time, the node id can be changed from the serial port)
+static byte nettime_reference() {
+	byte me = config.nodeId & RF12_HDR_MASK;
+	return nettime_ref && nettime_ref < me ? nettime_ref : me;
+}
+
+// a time sample from node sender, which follows reference ref
+// returns false if the sender disagrees with us, about the reference or by
+// more than NETTIME_STEP, so the broadcast scheduler knows to speak up
+static boolean nettime_heard(byte sender, byte ref, unsigned long remote) {
+	byte me = config.nodeId & RF12_HDR_MASK;
+	byte current = nettime_reference();
+	if (ref > current)
+		return false; // following a reference we already beat
+
+	unsigned long now = hal_millis();
+	long err = (long) (remote + NETTIME_LATENCY - network_millis());
+	long elapsed = now - nettime_local;
+	boolean far = err > NETTIME_STEP || err < -NETTIME_STEP;
+
+	// a sender with our own id is a twin: past 30 nodes ids repeat. Twin
+	// references meet half way, and settle big differences by the later clock
+	if (ref == me && sender != me)
+		return !far; // we are the reference, everybody else follows us
+
+	if (ref < current || (far && (sender == ref || err > 0))) {
+		// a better reference, or the reference restarted: take its time as it is
+		unsigned long before = network_millis();
+		nettime_ref = ref;
+		nettime_offset = remote + NETTIME_LATENCY - now;
+		nettime_drift = 0;
+		nettime_local = now;
+		nettime_jump = network_millis() - before;
+		++nettime_jumps;
+		return true;
+	}
+	if (far)
+		return false; // one of us is lost, leave it to the reference
+
+	// fold the drift so far into the offset, then correct the offset
+	// and fold a share of the error into the drift estimate
+	nettime_offset += (long) (((long long) elapsed * nettime_drift) >> 20) + err / 2;
+	nettime_local = now;
+	if (elapsed > 1000) {
+		nettime_drift += (long) (((long long) err << 20) / elapsed / 4);
+		if (nettime_drift > NETTIME_MAX_DRIFT)
+			nettime_drift = NETTIME_MAX_DRIFT;
+		else if (nettime_drift < -NETTIME_MAX_DRIFT)
+			nettime_drift = -NETTIME_MAX_DRIFT;
+	}
+	return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Random numbers
+// One generator for the patterns and the timers, see WireflyRandom.h, seeded
+// from the node id and the noise read from AIO1 in setup(). The id can still
+// change from the serial port after that, as the simulator sets it, so the
+// generator is seeded again whenever it does.
+
+static rand_state wirefly_rand;
+static uint32_t wirefly_noise;  // read once, in setup()
+static byte wirefly_randNode;   // node id it was seeded with
+
+static void wirefly_randomSeed() {
+	wirefly_randNode = config.nodeId & RF12_HDR_MASK;
+	rand_seed(&wirefly_rand, wirefly_randNode, wirefly_noise);
+}
+
+static rand_state* wirefly_randomState() {
+	if ((config.nodeId & RF12_HDR_MASK) != wirefly_randNode)
+		wirefly_randomSeed();
+	return &wirefly_rand;
+}
+
+// 0 to n - 1
+word wirefly_random(word n) {
+	return rand_below(wirefly_randomState(), n);
+}
+
+// lo to hi - 1
+word wirefly_randomRange(word lo, word hi) {
+	return rand_range(wirefly_randomState(), lo, hi);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Broadcast scheduling
+// Trickle (RFC 6206): time is cut into intervals, and we broadcast once at a
+// random point in the second half of each one, unless TRICKLE_K neighbours
+// already broadcast the same state during it. Every quiet interval doubles
+// the next, from TRICKLE_IMIN up to TRICKLE_IMAX, so a settled network goes
+// nearly silent whatever its size. Hearing a different state drops the
+// interval back to TRICKLE_IMIN, so changes still spread in a few hundred ms.
+
+#define TRICKLE_IMIN  1024UL   // ms, shortest interval
+#define TRICKLE_IMAX  65536UL  // ms, longest interval
+#define TRICKLE_K     2        // redundancy constant
+
+static unsigned long trickle_interval; // length of the current interval, ms
+static unsigned long trickle_start;    // millis() at which it began
+static unsigned long trickle_at;       // when in it we broadcast, ms from the start
+static byte trickle_heard;             // consistent broadcasts heard during it
+
+static void trickle_begin(unsigned long now) {
+	trickle_start = now;
+	trickle_at = trickle_interval / 2 + wirefly_random(trickle_interval / 2);
+	trickle_heard = 0;
+}
+
+// a neighbour broadcast the same state we have
+static void trickle_consistent() {
+	if (trickle_heard < 255)
+		++trickle_heard;
+}
+
+// we heard (or made) a change: talk fast again
+static void trickle_reset() {
+	if (trickle_interval == TRICKLE_IMIN)
+		return;
+	trickle_interval = TRICKLE_IMIN;
+	trickle_begin(hal_millis());
+}
+
+// true when it is our turn to broadcast
+static boolean trickle_poll() {
+	unsigned long now = hal_millis();
+	unsigned long elapsed = now - trickle_start;
+	boolean fire = false;
+
+	if (trickle_at != 0xFFFFFFFFUL && elapsed >= trickle_at) {
+		// the network time reference always speaks, see "Power"
+		fire = trickle_heard < TRICKLE_K || nettime_reference() == (config.nodeId & RF12_HDR_MASK);
+		trickle_at = 0xFFFFFFFFUL; // once per interval
+	}
+	if (elapsed >= trickle_interval) {
+		trickle_interval *= 2;
+		if (trickle_interval > TRICKLE_IMAX)
+			trickle_interval = TRICKLE_IMAX;
+		trickle_begin(now);
+	}
+	return fire;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Power
+// Between frames the MCU idles until the next interrupt, at most a timer
+// tick away. The radio can be duty cycled ('u' command): it only listens for
+// the first listen_window ms of every LISTEN_PERIOD of network time, and
+// frames only go out inside our window, so nodes that share a network time
+// hear each other while the receiver is off most of the time.
+// That only works for nodes already in step, so the network time reference
+// always listens, and speaks up once every Trickle interval, and a follower
+// that hasn't heard the reference itself for LISTEN_LONELY (a new node, or
+// one whose group has just moved to a better reference) listens all the
+// time until it does. The reference is best a node on mains power.
+// A node whose network time jumps leaves its old followers behind, so for
+// LISTEN_SHIFT after a jump it listens all the time and only transmits in
+// its old window, to take them along.
+// With the radio off and PATTERN_OFF showing, nothing needs the CPU until
+// the next window, so it powers down completely until then.
+// wirefly_powerCounters() says where the time went.
+
+#define LISTEN_PERIOD  1024UL               // ms of network time
+#define LISTEN_WINDOW  0                    // ms listening per period, 0 = always
+#define LISTEN_LONELY  (2 * TRICKLE_IMAX)   // ms without a frame before listening again
+#define LISTEN_SHIFT   (4 * LISTEN_PERIOD)  // ms after a jump talking in the old window
+#define SERIAL_TX_IDLE 63                   // availableForWrite() with nothing left to send
+
+static word listen_window = LISTEN_WINDOW;
+static boolean listen_on = true;      // the receiver is on
+static byte listen_ref;               // reference we last heard ourselves, 0 = none
+static unsigned long listen_refAt;    // millis() then
+static word listen_txAt;              // ms into our window at which we may send
+static unsigned long listen_period;   // the period listen_txAt was drawn for
+static byte listen_jumps;             // nettime_jumps last seen
+static long listen_shift;             // old network time - new, after a jump
+static unsigned long listen_shiftAt;  // millis() of the jump
+static wirefly_power power;
+static unsigned long power_at;        // millis() counted up to
+static unsigned long power_wokeUs;    // micros() at the last wake up
+
+// duty cycle the radio: listen window ms out of every LISTEN_PERIOD, 0 = always
+void wirefly_listen(word window) {
+	listen_window = window < LISTEN_PERIOD ? window : 0;
+}
+
+const wirefly_power* wirefly_powerCounters() {
+	return &power;
+}
+
+// how far into the current listen period network time is
+static word listen_phase() {
+	return network_millis() % LISTEN_PERIOD;
+}
+
+// true for a while after network time jumped; notices new jumps
+static boolean listen_shifted() {
+	if (listen_jumps != nettime_jumps) {
+		listen_jumps = nettime_jumps;
+		listen_shift = -nettime_jump;
+		listen_shiftAt = hal_millis();
+		if (listen_window)
+			trickle_reset(); // something to tell the old followers
+	}
+	return listen_window && hal_millis() - listen_shiftAt < LISTEN_SHIFT;
+}
+
+// true while the receiver should be on
+static boolean listen_now() {
+	byte ref = nettime_reference();
+	if (!listen_window || ref == (config.nodeId & RF12_HDR_MASK) || listen_shifted())
+		return true;
+	if (listen_ref != ref || hal_millis() - listen_refAt >= LISTEN_LONELY)
+		return true;
+	return listen_phase() < listen_window;
+}
+
+// true while we may transmit: inside our window (the old one, just after a
+// jump), past a point drawn at random for each period, so the nodes with
+// something to say don't all start at once when the window opens
+static boolean listen_mayTransmit() {
+	boolean shifted = listen_shifted();
+	if (!listen_window)
+		return true;
+	unsigned long t = network_millis() + (shifted ? listen_shift : 0);
+	if (t / LISTEN_PERIOD != listen_period) {
+		listen_period = t / LISTEN_PERIOD;
+		listen_txAt = wirefly_random(listen_window / 2);
+	}
+	word phase = t % LISTEN_PERIOD;
+	return phase >= listen_txAt && phase < listen_window;
+}
+
+// a frame from node sender came in
+static void listen_heard(byte sender) {
+	if (sender == nettime_reference()) {
+		listen_ref = sender;
+		listen_refAt = hal_millis();
+	}
+}
+
+// the end of a frame: switch the radio to suit the duty cycle and sleep,
+// as deeply as the LEDs and the serial port allow
+static void power_idle() {
+	unsigned long now = hal_millis();
+	power.awakeUs += hal_micros() - power_wokeUs;
+	if (listen_on)
+		power.listenMs += now - power_at;
+	power_at = now;
+
+	boolean listen = listen_now();
+	if (listen != listen_on) {
+		if (!listen)
+			hal_radioSendWait(0); // let a frame on the air finish first
+		hal_radioSleep(!listen);
+		listen_on = listen;
+	}
+
+	if (!listen && pattern_get() == PATTERN_OFF && !wirefly_msgPending()
+			&& Serial.availableForWrite() >= SERIAL_TX_IDLE) {
+		// until our next window; the serial port is lost until then
+		word slept = hal_powerDown(LISTEN_PERIOD - listen_phase());
+		power.sleepMs += slept;
+		power_at += slept;
+	}
+	else
+		hal_idle();
+	++power.wakeups;
+	power_wokeUs = hal_micros();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Pattern versions
+// Every pattern command gets a version: an epoch one past the newest we know
+// of, and the id of the node it was given to. Broadcasts carry the version and
+// nodes only adopt strictly newer ones, so a change spreads as a single wave,
+// and concurrent commands are settled the same way everywhere: the higher
+// epoch wins, then the higher originator id.
+
+static word pattern_epoch;  // version of the pattern we show, 0 = never commanded
+static byte pattern_origin; // node id the command was given to
+#ifdef LOOP_STATS
+static unsigned long loop_heardAt; // arrival of the pattern we just adopted
+static boolean loop_heard;         // not on the LEDs yet
+#endif
+
+// < 0, 0 or > 0 as the version of a pattern is older than, the same as or
+// newer than ours (serial number arithmetic, the epoch may wrap)
+static int pattern_compare(word epoch, byte origin, byte pattern) {
+	int d = (int16_t) (word) (epoch - pattern_epoch);
+	if (d == 0)
+		d = (int) origin - pattern_origin;
+	if (d == 0)
+		d = (int) pattern - pattern_get(); // twins, ids repeat past 30 nodes
+	return d;
+}
+
+// a pattern command, from the serial port: a new version, from us
+void wirefly_command(int value) {
+	++pattern_epoch;
+	pattern_origin = config.nodeId & RF12_HDR_MASK;
+	pattern_set(value);
+	TRACE(TRACE_PATTERN, value, pattern_epoch, pattern_origin);
+	trickle_reset(); //we want to spread the news quickly
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Message handlers, see wirefly_subscribe()
+
+// the sender's network time: a neighbour that disagrees needs to hear from us
+static void wirefly_onTime(byte sender, const byte* value, byte len) {
+	if (len < 5)
+		return;
+	if (!nettime_heard(sender, value[0],
+			((unsigned long) value[1] << 24) | ((unsigned long) value[2] << 16) |
+			((unsigned long) value[3] << 8) | value[4]))
+		trickle_reset();
+	listen_heard(sender);
+}
+
+// the sender's pattern and its version
+static void wirefly_onPattern(byte sender, const byte* value, byte len) {
+	if (len < 4)
+		return;
+	word epoch = (value[1] << 8) | value[2];
+	int newer = pattern_compare(epoch, value[3], value[0]);
+	if (newer > 0)
+	{
+		//set the new pattern
+		pattern_epoch = epoch;
+		pattern_origin = value[3];
+		pattern_set(value[0]);
+		TRACE(TRACE_PATTERN, value[0], epoch, value[3]);
+#ifdef LOOP_STATS
+		loop_heardAt = wirefly_rxTime();
+		loop_heard = true;
+#endif
+	}
+	// a neighbour that agrees with us makes our broadcast redundant,
+	// one that doesn't needs to hear from us, and one that just
+	// changed our mind needs us to pass it on
+	if (newer == 0)
+		trickle_consistent();
+	else
+		trickle_reset();
+}
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // Main loop functions, top-level / timing functions 
@@ -30,16 +409,40 @@ static int WIREFLY_TIMER_IMMUNE = 16384;
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 void loop() {
 	// the next three statements are intended to be equivalent to rf12_loop()
+#ifdef LOOP_STATS
+	unsigned long t0 = hal_micros();
+#endif
 
 	//PHASE1: input, listen
-	wirefly_interrupt(); // note that patterns can call pattern_interrupt(), on their own time
+	wirefly_interrupt(); // patterns never block, so this runs once per frame
+#ifdef LOOP_STATS
+	unsigned long t1 = hal_micros();
+#endif
 
-	//PHASE2: communicate
-	wirefly_send(); //send a pending message, if (needToSend != 0)
+	//PHASE2: display
+	pattern_run();  // ticks the active pattern, returns promptly
+	wirefly_recvDone(); // and get the radio listening again, if a frame came in meanwhile
+#ifdef LOOP_STATS
+	unsigned long t2 = hal_micros();
+	if (loop_heard) { // a pattern from the radio is on the LEDs now
+		stats_add(STATS_APPLY, t2 - loop_heardAt);
+		loop_heard = false;
+	}
+#endif
 
-	//PHASE3: display
-	pattern_run();  // switches control to the active pattern
+	//PHASE3: communicate
+	wirefly_send(); //send the outgoing frame, with whatever the pattern just added to it
 
+	trace_drain(); // as much of the trace as the serial port takes without waiting
+#ifdef LOOP_STATS
+	unsigned long t3 = hal_micros();
+	stats_add(STATS_INPUT, t1 - t0);
+	stats_add(STATS_DISPLAY, t2 - t1);
+	stats_add(STATS_SEND, t3 - t2);
+	stats_add(STATS_FRAME, t3 - t0);
+#endif
+
+	power_idle(); // until the next frame, or the next listen window
 }
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
@@ -57,43 +460,13 @@ int wirefly_interrupt() {
         handleInput(Serial.read());
 #endif
 
-	// check for network input via rf12_recvDone()
-	if (wirefly_recvDone())
-	{
-		// check for the pattern data and grab it
-		if (rf12_data[0] == WIREFLY_SEND_PATTERN && !pattern_immuneTimer.poll())
-		{
-			int new_pattern = rf12_data[1];
-			//set the new pattern
-			pattern_set(new_pattern);
-		}
-	}
-	//check to see if either serial or network changed the pattern
-	boolean patternChanged = (pattern_get() != current_pattern);
-	if (patternChanged) {
-#ifdef SERIAL_DEBUG
-		// log if new pattern detected
-		Serial.print("wirefly_interrupt() old pattern: ");
-		Serial.print(current_pattern);
-		Serial.print("  new: ");
-		Serial.println(pattern_get());
-#endif
-		pattern_immuneTimer.set(WIREFLY_TIMER_IMMUNE); //don't listen for a little while
-		wirefly_sendTimer.set(0); //we want to send a message quickly
-	}
-
-	return patternChanged;
-}
+	// hand the frames in the receive ring to their handlers
+	wirefly_recvDone();
+	wirefly_dispatch();
 
-// = = = = = = = = = = = = = = = = = = = = = = = = = = =
-// delay function - // use these, don't waste cycles with delay()
-// poll for new inputs and break if an interrupt is detected
-boolean wirefly_delay(unsigned long wait_time) {
-	unsigned long t0 = millis();
-	while ((millis() - t0) < wait_time)
-		if (wirefly_interrupt())
-			return false;
-	return true;
+	//check to see if either serial or network changed the pattern; the
+	//change itself is traced where it is made, TRACE_PATTERN
+	return pattern_get() != current_pattern;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -102,36 +475,31 @@ boolean wirefly_delay(unsigned long wait_time) {
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // wirefly_recvDone
+// Moves a received frame into the receive ring, so the radio can listen for
+// the next one straight away; wirefly_interrupt() dispatches it later.
+// Call it often, the radio is deaf from the end of one frame until this runs.
 // returns 1 if a message was received successfully
 int wirefly_recvDone() {
   int msgReceived = 0;
   // (receive a network message if one exists; keep the RF12 library happy)
-  // rf12_recvDone() needs to be constantly called in order to recieve new transmissions.
+  // hal_radioRecvDone() needs to be constantly called in order to recieve new transmissions.
   // It checks to see if a packet has been received, returns true if it has
-  if (rf12_recvDone()) {
-    byte n = rf12_len;
+  if (hal_radioRecvDone()) {
     // if we got a bad crc, then no message was received.
-    msgReceived = !rf12_crc;
-    if (rf12_crc == 0) {
-      showString(PSTR("OK"));
-      // If a new transmission comes in and CRC is ok, don't poll recv state again -
-      // otherwise rf12_crc, rf12_len, and rf12_data will be reset.
+    msgReceived = !hal_radioCrc;
+    if (hal_radioCrc == 0) {
       activityLed(1);
-      //ack if requested
-      if (RF12_WANTS_ACK && (config.collect_mode) == 0) {
-        showString(PSTR("Send -> ack\n"));
-        rf12_sendStart(RF12_ACK_REPLY, 0, 0);
-        rf12_sendWait(1); // don't power down too soon
-      }
+      if (wirefly_rxPush(hal_radioHdr, hal_radioData, hal_radioLen))
+        TRACE(TRACE_RX, hal_radioHdr & RF12_HDR_MASK, hal_radioLen, 0);
+      else
+        TRACE(TRACE_DROP, hal_radioHdr & RF12_HDR_MASK, wirefly_rxDrops(), 0);
+      //ack if requested, wirefly_send() sends it ahead of anything else
+      if (RF12_WANTS_ACK && (config.collect_mode) == 0)
+        wirefly_msgAck(RF12_ACK_REPLY);
       activityLed(0);
     }
-    else {
-        if (config.quiet_mode)
-            return msgReceived;
-        showString(PSTR(" ?"));
-        if (n > 20) // print at most 20 bytes if crc is wrong
-            n = 20;
-    }
+    else if (!config.quiet_mode)
+      TRACE(TRACE_BADCRC, hal_radioLen, 0, 0);
   }
   return msgReceived;
 }
@@ -139,33 +507,53 @@ int wirefly_recvDone() {
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // wirefly_send
 // Call this a lot, it will decide whether to send the broadcast or not.
+// Our pattern goes in the transmit queue when the trickle timer says so; the
+// queue goes out a frame at a time whenever the channel is free, most urgent
+// records first. Never waits for the radio.
+// returns 1 if a frame went out
 int wirefly_send() {
-	// every four seconds
-	if (wirefly_sendTimer.poll(WIREFLY_TIMER_BROADCAST))
-		wirefly_needToSend = 1;
-  //if rf12_canSend returns 1, then you must subsequently call rf12_sendStart.
-  if (wirefly_needToSend && rf12_canSend()) {
-    activityLed(1);
+	byte* rec;
+	// when the trickle timer says so
+	if (trickle_poll() && (rec = wirefly_msgQueue(WIREFLY_SEND_PATTERN, WIREFLY_PRIO_PATTERN, 4))) {
+		rec[0] = pattern_get(); //send the pattern as integer
+		rec[1] = pattern_epoch >> 8; //its version
+		rec[2] = pattern_epoch;
+		rec[3] = pattern_origin;
+	}
+
+  //if hal_radioCanSend returns 1, then you must subsequently call hal_radioSend.
+  if (!wirefly_msgPending() || !listen_on || !listen_mayTransmit() || !hal_radioCanSend())
+    return 0;
+
+  activityLed(1);
+  byte header;
+  if (wirefly_msgTakeAck(&header)) {
+    TRACE(TRACE_ACK, header, 0, 0);
+    hal_radioSend(header, 0, 0);
+  }
+  else {
     //do yo thang:
-    wirefly_msg_stack[0] = WIREFLY_SEND_PATTERN;
-    wirefly_msg_stack[1] = pattern_get(); //send the pattern as integer
-    wirefly_msg_sendLen = 2;
-    wirefly_msg_dest = 0; //broadcast message
-#ifdef SERIAL_DEBUG
-    showString(PSTR("Send -> "));
-    Serial.println((byte) wirefly_msg_stack[0]);
-#endif
-    //make this an ack if requested
-    byte header = wirefly_msg_cmd == 'a' ? RF12_HDR_ACK : 0;
-    // if not broadcast, set the destination node
-    if (wirefly_msg_dest)
-        header |= RF12_HDR_DST | wirefly_msg_dest;
-    //actually send the message:
-    wirefly_needToSend = 0;
-    rf12_sendStart(header, wirefly_msg_stack, wirefly_msg_sendLen);
-    wirefly_msg_cmd = 0;
-    activityLed(0);
+    word types = wirefly_msgTake();
+    // the pattern carries our network time, read as late as possible
+    if ((types & (1 << WIREFLY_SEND_PATTERN)) && (rec = wirefly_msgAdd(WIREFLY_SEND_TIME, 5))) {
+      unsigned long t = network_millis();
+      rec[0] = nettime_reference();
+      rec[1] = t >> 24;
+      rec[2] = t >> 16;
+      rec[3] = t >> 8;
+      rec[4] = t;
+    }
+    // and a clock sync ping its phase
+    if ((types & (1 << WIREFLY_SEND_CLOCKSYNC)) && (rec = wirefly_msgFind(WIREFLY_SEND_CLOCKSYNC)))
+      pattern_clockSyncStamp(rec);
+    byte len;
+    const byte* frame = wirefly_msgFrame(&len);
+    TRACE(TRACE_TX, len, types, 0);
+    //actually send the message, as a broadcast:
+    hal_radioSend(0, frame, len);
   }
+  activityLed(0);
+  return 1;
 }
 
 
@@ -175,9 +563,16 @@ int wirefly_send() {
 void setup() {
   rf12_setup();
 
+	pattern_begin();
 	pattern_set(PATTERN_OFF);
-	randomSeed(analogRead(0));
-	wirefly_sendTimer.set(0); //we want to send a message quickly
+	wirefly_noise = rand_noise(analogRead, 0);
+	wirefly_randomSeed();
+	trickle_interval = TRICKLE_IMIN; //we want to send a message quickly
+	trickle_begin(hal_millis());
+	power_at = hal_millis();
+	power_wokeUs = hal_micros();
+	wirefly_subscribe(WIREFLY_SEND_PATTERN, wirefly_onPattern);
+	wirefly_subscribe(WIREFLY_SEND_TIME, wirefly_onTime);
 
   //set the AIO pin on the jeeNode to be an output pin
   pinMode(A1, OUTPUT);
@@ -0,0 +1,34 @@
+#ifndef __WIREFLY_HAL_H
+#define __WIREFLY_HAL_H
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Hardware abstraction layer
+//
+// Everything the wirefly firmware needs from the board goes through here:
+//   hal_millis(), hal_micros()          clock
+//   hal_pwmWrite(pin, value)            LED outputs
+//   hal_tickBegin(fn)                   fn() HAL_TICK_HZ times a second
+//   hal_portMode(), hal_portWrite(), hal_planeBegin(fn), hal_planeNext()
+//                                       port pins and timer for bam.h
+//   hal_stripClock(on), hal_usartSpiBegin(), hal_usartSpiWrite()
+//                                       strip clock and USART for strip.h
+//   hal_idle(), hal_powerDown(ms), hal_radioSleep(off)
+//                                       power saving
+//   hal_radioRecvDone(), hal_radioCanSend(), hal_radioSend(), hal_radioSendWait()
+//   hal_radioData, hal_radioLen, hal_radioHdr, hal_radioCrc, hal_radioGrp
+//                                       the RF12 packet driver
+//
+// hal_avr.h maps these straight onto the Arduino core and JeeLib for the
+// JeeNode. host/hal_linux.h implements them on Linux with a virtual,
+// fast-forwardable clock, a recording PWM sink and an in-memory radio, so
+// the same pattern_run() / wirefly_interrupt() / wirefly_send() code builds
+// into a native executable (see host/Makefile).
+
+#if defined(__AVR__)
+#include "hal_avr.h"
+#else
+#include "host/hal_linux.h"
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+// JeeNode implementation of the wirefly HAL, the parts that can't be inline,
+// see hal_avr.h
+
+#if defined(__AVR__)
+
+#include "hal.h"
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// tick
+// Timer 0 is millis() and the PWM on pins 5 and 6, timer 2 the PWM on pin 3,
+// so the tick takes timer 1: clk/8, compare match A every 1/HAL_TICK_HZ s.
+
+static void (*tick_fn)();
+
+void hal_tickBegin(void (*fn)()) {
+	tick_fn = fn;
+	cli();
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12) | _BV(CS11);
+	TCNT1 = 0;
+	OCR1A = F_CPU / 8 / HAL_TICK_HZ - 1;
+	TIMSK1 |= _BV(OCIE1A);
+	sei();
+}
+
+ISR(TIMER1_COMPA_vect) {
+	if (tick_fn)
+		tick_fn();
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// plane timer
+// Timer 2, CTC: the count starts over at every match, so hal_planeNext()
+// only has to load the next plane's clock and length.
+
+static void (*plane_fn)();
+
+void hal_planeBegin(void (*fn)()) {
+	plane_fn = fn;
+	cli();
+	TCCR2A = _BV(WGM21);
+	TCCR2B = 1;
+	TCNT2 = 0;
+	OCR2A = 255;
+	TIMSK2 |= _BV(OCIE2A);
+	sei();
+}
+
+ISR(TIMER2_COMPA_vect) {
+	if (plane_fn)
+		plane_fn();
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// strip outputs
+
+// timer 2, CTC, toggling OC2B every 16 cycles; off, the pin is PORTD's again
+void hal_stripClock(byte on) {
+	if (on) {
+		OCR2A = 15;
+		OCR2B = 15;
+		TCCR2B = _BV(CS20);
+		TCCR2A = _BV(COM2B0) | _BV(WGM21);
+	} else
+		TCCR2A = _BV(WGM21);
+}
+
+// master SPI mode 0, MSB first, F_CPU / 6; the transmitter is only on while
+// writing, so TXD is held low by the port in between
+void hal_usartSpiBegin() {
+	UBRR0 = 0;
+	PORTD &= ~_BV(PD1);
+	DDRD |= _BV(PD1) | _BV(PD4);
+	UCSR0B = 0;
+	UCSR0C = _BV(UMSEL01) | _BV(UMSEL00);
+	UBRR0 = 2;
+}
+
+// send len bytes back to back, and wait until the last has gone
+void hal_usartSpiWrite(const byte* data, byte len) {
+	UCSR0A = _BV(TXC0); // clears it
+	UCSR0B = _BV(TXEN0);
+	for (byte i = 0; i < len; ++i) {
+		while (!(UCSR0A & _BV(UDRE0)))
+			;
+		UDR0 = data[i];
+	}
+	while (!(UCSR0A & _BV(TXC0)))
+		;
+	UCSR0B = 0;
+}
+
+#endif
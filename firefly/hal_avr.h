@@ -0,0 +1,125 @@
+#ifndef __WIREFLY_HAL_AVR_H
+#define __WIREFLY_HAL_AVR_H
+
+// JeeNode implementation of the wirefly HAL, see hal.h
+// Thin inline wrappers around the Arduino core and the JeeLib RF12 driver.
+
+#include <JeeLib.h>
+#include <util/crc16.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/parity.h>
+#include <avr/sleep.h>
+
+#include "Arduino.h"
+
+#define HAL_AVR 1
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// clock
+static inline unsigned long hal_millis() {
+	return millis();
+}
+
+static inline unsigned long hal_micros() {
+	return micros();
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// LED outputs
+static inline void hal_pwmWrite(byte pin, byte value) {
+	analogWrite(pin, value);
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// tick
+// Timer 1 in CTC mode, see hal_avr.cpp; pins 9 and 10 lose their PWM to it.
+#define HAL_TICK_HZ  1000
+
+void hal_tickBegin(void (*fn)());
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// ports and plane timer, for bit angle modulation (bam.h)
+// Ports 0, 1, 2 are B, C, D. The plane timer is timer 2 in CTC mode, see
+// hal_avr.cpp; pins 3 and 11 lose their PWM to it.
+static inline volatile uint8_t* hal_port(byte port) {
+	return port == 0 ? &PORTB : port == 1 ? &PORTC : &PORTD;
+}
+
+// make the pins in mask outputs
+static inline void hal_portMode(byte port, byte mask) {
+	*(port == 0 ? &DDRB : port == 1 ? &DDRC : &DDRD) |= mask;
+}
+
+// set the pins in mask to bits, leave the others alone
+static inline void hal_portWrite(byte port, byte mask, byte bits) {
+	volatile uint8_t* r = hal_port(port);
+	*r = (*r & ~mask) | bits;
+}
+
+void hal_planeBegin(void (*fn)());
+
+// from the plane timer's fn: call it again count (1 to 256) timer clocks on,
+// with clock select 1 to 7 (see bam_prescale())
+static inline void hal_planeNext(byte select, word count) {
+	TCCR2B = select;
+	OCR2A = count - 1;
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// strip outputs (strip.h), in hal_avr.cpp
+// hal_stripClock(): timer 2 toggling IRQ (PD3, OC2B) at 500 kHz, or not.
+// hal_usartSpi*(): USART0 as a master SPI at 2.67 MHz, TXD out, no serial.
+void hal_stripClock(byte on);
+void hal_usartSpiBegin();
+void hal_usartSpiWrite(const byte* data, byte len);
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// power saving
+
+// sleep until the next interrupt: timer 0 wakes us within the millisecond,
+// and the PWM outputs keep running
+static inline void hal_idle() {
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_mode();
+}
+
+// power down for about ms (the watchdog counts in 16 ms steps), PWM and
+// serial stopped; returns the ms actually slept, millis() moves on by as much
+static inline word hal_powerDown(word ms) {
+	unsigned long before = millis();
+	Sleepy::loseSomeTime(ms);
+	return millis() - before;
+}
+
+// switch the receiver off (1) or back on (0)
+static inline void hal_radioSleep(byte off) {
+	rf12_sleep(off ? RF12_SLEEP : RF12_WAKEUP);
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// RF12 packet driver
+static inline byte hal_radioRecvDone() {
+	return rf12_recvDone();
+}
+
+static inline byte hal_radioCanSend() {
+	return rf12_canSend();
+}
+
+static inline void hal_radioSend(byte hdr, const void* ptr, byte len) {
+	rf12_sendStart(hdr, ptr, len);
+}
+
+static inline void hal_radioSendWait(byte mode) {
+	rf12_sendWait(mode);
+}
+
+// the last packet received by hal_radioRecvDone()
+#define hal_radioData rf12_data
+#define hal_radioLen  rf12_len
+#define hal_radioHdr  rf12_hdr
+#define hal_radioCrc  rf12_crc
+#define hal_radioGrp  rf12_grp
+
+#endif
@@ -0,0 +1,414 @@
+// Linux implementation of the wirefly HAL, see hal_linux.h
+
+#include <stdio.h>
+
+#include "hal_linux.h"
+
+static hal_host_hooks hooks;
+static unsigned long clock_us;
+
+byte hal_radioData[RF12_MAXDATA];
+byte hal_radioLen;
+byte hal_radioHdr;
+word hal_radioCrc;
+byte hal_radioGrp = 0xD4;
+
+byte hal_hostSerialEcho = 1;
+byte hal_hostPwm[HAL_HOST_PINS];
+unsigned long hal_hostRadioDrops;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// clock
+
+unsigned long hal_millis() {
+	return clock_us / 1000;
+}
+
+unsigned long hal_micros() {
+	return clock_us;
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// tick
+
+#define TICK_US (1000000UL / HAL_TICK_HZ)
+
+static void (*tick_fn)();
+static unsigned long tick_at;  // clock_us of the next tick
+
+void hal_tickBegin(void (*fn)()) {
+	tick_fn = fn;
+	tick_at = clock_us + TICK_US;
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// ports and plane timer
+
+#define CYCLES_US (F_CPU / 1000000UL)
+
+byte hal_hostPorts[HAL_HOST_PORTS];
+
+static void (*plane_fn)();
+static unsigned long plane_at;  // clock_us of the next plane
+static byte plane_cycles;       // and cpu cycles past it
+
+void hal_portWrite(byte port, byte mask, byte bits) {
+	if (port < HAL_HOST_PORTS)
+		hal_hostPorts[port] = (hal_hostPorts[port] & ~mask) | bits;
+}
+
+void hal_planeBegin(void (*fn)()) {
+	plane_fn = fn;
+	plane_at = clock_us;
+	plane_cycles = 0;
+	hal_planeNext(1, 256);
+}
+
+void hal_planeNext(byte select, word count) {
+	static const word prescale[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+	unsigned long cycles = plane_cycles + (unsigned long) count * prescale[select & 7];
+	plane_at += cycles / CYCLES_US;
+	plane_cycles = cycles % CYCLES_US;
+}
+
+// move the clock on, running the tick and the plane timer on the way
+static void clock_run(unsigned long us) {
+	unsigned long end = clock_us + us;
+	for (;;) {
+		byte tick = tick_fn && (long) (end - tick_at) >= 0;
+		byte plane = plane_fn && (long) (end - plane_at) >= 0;
+		if (plane && (!tick || (long) (tick_at - plane_at) > 0)) {
+			clock_us = plane_at;
+			plane_fn(); // calls hal_planeNext()
+		} else if (tick) {
+			clock_us = tick_at;
+			tick_at += TICK_US;
+			tick_fn();
+		} else
+			break;
+	}
+	clock_us = end;
+}
+
+void hal_hostAdvance(unsigned long us) {
+	clock_run(us);
+}
+
+void delay(unsigned long ms) {
+	clock_run(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	clock_run(us);
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// LED outputs
+
+void hal_pwmWrite(byte pin, byte value) {
+	if (pin < HAL_HOST_PINS)
+		hal_hostPwm[pin] = value;
+	if (hooks.pwm)
+		hooks.pwm(hooks.ctx, pin, value);
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// RF12 packet driver
+//
+// Like the real driver there is a single receive buffer: once a frame has
+// arrived the receiver stays off until the firmware has seen it through
+// hal_radioRecvDone() and called it once more to re-arm. And like rf12_canSend(),
+// a hal_radioCanSend() that says yes leaves the radio idle, deaf, until
+// hal_radioSend() or the next hal_radioRecvDone().
+
+static struct {
+	byte full;      // a frame arrived, hal_radioRecvDone() has not seen it yet
+	byte held;      // hal_radioRecvDone() returned a frame, still being read
+	byte hdr, len;
+	byte data[RF12_MAXDATA];
+} rx;
+
+static byte radio_off;
+static byte tx_idle;           // hal_radioCanSend() said yes, no send yet
+static unsigned long wake_us;  // powered down until then
+
+word hal_powerDown(word ms) {
+	wake_us = clock_us + ms * 1000UL;
+	return ms;
+}
+
+byte hal_hostAsleep() {
+	return (long) (clock_us - wake_us) < 0;
+}
+
+void hal_radioSleep(byte off) {
+	radio_off = off;
+}
+
+byte hal_hostDeliver(byte hdr, const byte* data, byte len) {
+	if (radio_off)
+		return 0;
+	if (rx.full || rx.held || tx_idle || len > RF12_MAXDATA) {
+		++hal_hostRadioDrops;
+		return 0;
+	}
+	rx.hdr = hdr;
+	rx.len = len;
+	memcpy(rx.data, data, len);
+	rx.full = 1;
+	return 1;
+}
+
+byte hal_radioRecvDone() {
+	rx.held = 0; // re-arm the receiver
+	tx_idle = 0;
+	if (!rx.full)
+		return 0;
+	rx.full = 0;
+	rx.held = 1;
+	hal_radioHdr = rx.hdr;
+	hal_radioLen = rx.len;
+	hal_radioCrc = 0;
+	memcpy(hal_radioData, rx.data, rx.len);
+	return 1;
+}
+
+byte hal_radioCanSend() {
+	if (rx.full || (hooks.busy && hooks.busy(hooks.ctx)))
+		return 0;
+	tx_idle = 1;
+	return 1;
+}
+
+void hal_radioSend(byte hdr, const void* ptr, byte len) {
+	// like the RF12 driver, broadcasts carry the sender's node id
+	if (!(hdr & RF12_HDR_DST))
+		hdr = (hdr & ~RF12_HDR_MASK) | rf12_configSilent();
+	tx_idle = 0;
+	if (hooks.transmit)
+		hooks.transmit(hooks.ctx, hdr, (const byte*) ptr, len);
+}
+
+void hal_radioSendWait(byte mode) {
+}
+
+void hal_hostAttach(const hal_host_hooks* h) {
+	hooks = *h;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Arduino core
+
+static int noise;
+static unsigned long seed = 1;
+
+void hal_hostSetNoise(int value) {
+	noise = value;
+}
+
+int analogRead(byte pin) {
+	return noise;
+}
+
+void randomSeed(unsigned long s) {
+	if (s != 0)
+		seed = s;
+}
+
+long random(long howbig) {
+	if (howbig == 0)
+		return 0;
+	// same Park-Miller generator as avr-libc random()
+	long hi = seed / 127773L;
+	long lo = seed % 127773L;
+	long x = 16807L * lo - 2836L * hi;
+	if (x < 0)
+		x += 0x7fffffffL;
+	seed = x;
+	return (x % 0x7fffffffL) % howbig;
+}
+
+long random(long howsmall, long howbig) {
+	if (howsmall >= howbig)
+		return howsmall;
+	return random(howbig - howsmall) + howsmall;
+}
+
+HalSerial Serial;
+
+static char serial_in[256];
+static size_t serial_head, serial_tail;
+
+void hal_hostSerialInput(const char* s) {
+	for (; *s; ++s) {
+		size_t next = (serial_head + 1) % sizeof serial_in;
+		if (next == serial_tail)
+			break;
+		serial_in[serial_head] = *s;
+		serial_head = next;
+	}
+}
+
+int HalSerial::available() {
+	return (serial_head + sizeof serial_in - serial_tail) % sizeof serial_in;
+}
+
+int HalSerial::read() {
+	if (serial_head == serial_tail)
+		return -1;
+	char c = serial_in[serial_tail];
+	serial_tail = (serial_tail + 1) % sizeof serial_in;
+	return (byte) c;
+}
+
+// the transmit buffer of the AVR core, emptied at SERIAL_BAUD on the virtual
+// clock, so availableForWrite() says what the hardware would
+#define SERIAL_TX_BUFFER  64
+#define SERIAL_BAUD       57600
+
+static unsigned long serial_txUs;  // level last worked out then
+static size_t serial_txLevel;
+
+static void serial_txDrain() {
+	unsigned long now = hal_micros();
+	size_t sent = (unsigned long long) (now - serial_txUs) * (SERIAL_BAUD / 10) / 1000000;
+	if (sent >= serial_txLevel) {
+		serial_txLevel = 0;
+		serial_txUs = now;
+	}
+	else if (sent) {
+		serial_txLevel -= sent;
+		serial_txUs += sent * 1000000ULL / (SERIAL_BAUD / 10);
+	}
+}
+
+int HalSerial::availableForWrite() {
+	serial_txDrain();
+	return SERIAL_TX_BUFFER - 1 - serial_txLevel;
+}
+
+size_t HalSerial::write(const uint8_t* buf, size_t len) {
+	serial_txDrain();
+	serial_txLevel += len; // the AVR would block here until it fits
+	if (serial_txLevel > SERIAL_TX_BUFFER - 1)
+		serial_txLevel = SERIAL_TX_BUFFER - 1;
+	if (hal_hostSerialEcho)
+		fwrite(buf, 1, len, stdout);
+	return len;
+}
+
+size_t HalSerial::write(uint8_t c) {
+	return write(&c, 1);
+}
+
+static size_t serial_printf(const char* fmt, ...) {
+	char buf[32];
+	va_list argv;
+	va_start(argv, fmt);
+	int n = vsnprintf(buf, sizeof buf, fmt, argv);
+	va_end(argv);
+	return Serial.write((const uint8_t*) buf, n < (int) sizeof buf ? n : sizeof buf - 1);
+}
+
+size_t HalSerial::print(const char* s) {
+	return write((const uint8_t*) s, strlen(s));
+}
+
+size_t HalSerial::print(char c) {
+	return write((const uint8_t*) &c, 1);
+}
+
+size_t HalSerial::print(int n) {
+	return serial_printf("%d", n);
+}
+
+size_t HalSerial::print(unsigned int n) {
+	return serial_printf("%u", n);
+}
+
+size_t HalSerial::print(long n) {
+	return serial_printf("%ld", n);
+}
+
+size_t HalSerial::print(unsigned long n) {
+	return serial_printf("%lu", n);
+}
+
+size_t HalSerial::print(double n) {
+	return serial_printf("%.2f", n);
+}
+
+size_t HalSerial::println() {
+	return print("\r\n");
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// JeeLib
+
+// same logic as JeeLib's MilliTimer, including the 16-bit wraparound
+byte MilliTimer::poll(word ms) {
+	byte ready = 0;
+	if (armed) {
+		word remain = next - hal_millis();
+		// since remain is unsigned, it will overflow to large values when
+		// the timeout is reached
+		if (remain <= 60000)
+			return 0;
+		ready = -remain;
+	}
+	set(ms);
+	return ready;
+}
+
+word MilliTimer::remaining() const {
+	word remain = armed ? next - hal_millis() : 0;
+	return remain <= 60000 ? remain : 0;
+}
+
+void MilliTimer::set(word ms) {
+	armed = ms != 0;
+	if (armed)
+		next = hal_millis() + ms - 1;
+}
+
+static byte eeprom[1024];
+
+byte eeprom_read_byte(const uint8_t* addr) {
+	return eeprom[(size_t) addr % sizeof eeprom];
+}
+
+void eeprom_write_byte(uint8_t* addr, byte value) {
+	eeprom[(size_t) addr % sizeof eeprom] = value;
+}
+
+// same polynomial as avr-libc _crc16_update()
+word _crc16_update(word crc, byte data) {
+	crc ^= data;
+	for (byte i = 0; i < 8; ++i)
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	return crc;
+}
+
+byte parity_even_bit(byte value) {
+	return __builtin_parity(value);
+}
+
+// like the real driver, the config is valid once a node id has been saved
+// to the (in-memory) EEPROM; the first setup() saves RF12.h's defaults
+byte rf12_configSilent() {
+	return eeprom_read_byte(RF12_EEPROM_ADDR) & RF12_HDR_MASK;
+}
+
+void rf12_configDump() {
+}
+
+byte rf12_initialize(byte id, byte band, byte group, word frequency) {
+	return id;
+}
+
+void rf12_sendNow(byte hdr, const void* ptr, byte len) {
+	hal_radioSend(hdr, ptr, len);
+}
@@ -0,0 +1,235 @@
+#ifndef __WIREFLY_HAL_LINUX_H
+#define __WIREFLY_HAL_LINUX_H
+
+// Linux implementation of the wirefly HAL, see hal.h
+//
+// The clock is virtual: it only moves when the host runner calls
+// hal_hostAdvance(), so a simulated hour takes as long as the firmware
+// needs to compute it. hal_pwmWrite() records the last value of every pin
+// and reports each write to the runner, and the radio is an in-memory RF12
+// with the same one-packet buffer semantics as the real driver.
+//
+// Below the HAL proper is the small slice of the Arduino core and JeeLib
+// that firefly.ino and RF12.h use for their serial command interpreter
+// (Serial, MilliTimer, EEPROM config, ...), just enough to compile and
+// behave sensibly on the host.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+
+#define HAL_HOST 1
+
+// the JeeNode's clock, for timings worked out at compile time
+#define F_CPU 16000000UL
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// clock
+unsigned long hal_millis();
+unsigned long hal_micros();
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// LED outputs
+void hal_pwmWrite(byte pin, byte value);
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// tick
+// Called from hal_hostAdvance() and delay() for every tick the clock passes,
+// before the runner's next loop(), as the timer interrupt would have been.
+#define HAL_TICK_HZ  1000
+
+void hal_tickBegin(void (*fn)());
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// ports and plane timer, for bit angle modulation (bam.h)
+// The ports are three bytes, hal_hostPorts[]; the plane timer runs from the
+// clock like the tick, to the cpu cycle.
+#define HAL_HOST_PORTS 3
+
+static inline void hal_portMode(byte, byte) {}
+void hal_portWrite(byte port, byte mask, byte bits);
+void hal_planeBegin(void (*fn)());
+void hal_planeNext(byte select, word count);
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// strip outputs (strip.h)
+// Nothing to clock; the LPD6803 frame shows in hal_hostPorts[] as it goes.
+static inline void hal_stripClock(byte) {}
+static inline void hal_usartSpiBegin() {}
+static inline void hal_usartSpiWrite(const byte*, byte) {}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// power saving
+// hal_idle() returns at once, the runner's frame is the next tick.
+// hal_powerDown() only notes the wake up time: the runner leaves the node
+// alone until then (see hal_hostAsleep()) and the clock moves on meanwhile.
+static inline void hal_idle() {}
+word hal_powerDown(word ms);
+void hal_radioSleep(byte off);
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// RF12 packet driver
+#define RF12_MAXDATA    66
+
+byte hal_radioRecvDone();
+byte hal_radioCanSend();
+void hal_radioSend(byte hdr, const void* ptr, byte len);
+void hal_radioSendWait(byte mode);
+
+// the last packet received by hal_radioRecvDone()
+extern byte hal_radioData[RF12_MAXDATA];
+extern byte hal_radioLen;
+extern byte hal_radioHdr;
+extern word hal_radioCrc;
+extern byte hal_radioGrp;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Host runner controls, never called by the firmware itself
+
+// Hooks connect a node to whatever is running it: a single-node runner or
+// the multi-node simulator. Any of them may be left null.
+typedef struct {
+	void* ctx;
+	// a frame the node put on the air, from hal_radioSend()
+	void (*transmit)(void* ctx, byte hdr, const byte* data, byte len);
+	// true while the channel is in use, hal_radioCanSend() fails
+	byte (*busy)(void* ctx);
+	// every hal_pwmWrite(), at the node's current virtual time
+	void (*pwm)(void* ctx, byte pin, byte value);
+} hal_host_hooks;
+
+#define HAL_HOST_PINS 20
+
+void hal_hostAttach(const hal_host_hooks* hooks);
+// fast forward the virtual clock by us microseconds
+void hal_hostAdvance(unsigned long us);
+// offer a received frame to the radio, returns 0 if the radio was not
+// listening (the real RF12 drops packets while one is waiting to be read,
+// or while it is idle between hal_radioCanSend() and hal_radioSend(), and
+// hears nothing while asleep)
+byte hal_hostDeliver(byte hdr, const byte* data, byte len);
+// true while the node is powered down, loop() must not run
+byte hal_hostAsleep();
+// queue characters for Serial.read()
+void hal_hostSerialInput(const char* s);
+// value analogRead() returns, the firmware seeds random() from it
+void hal_hostSetNoise(int value);
+
+extern byte hal_hostSerialEcho;       // copy Serial output to stdout
+extern byte hal_hostPwm[HAL_HOST_PINS]; // last value written to each pin
+extern byte hal_hostPorts[HAL_HOST_PORTS]; // port pins as hal_portWrite() left them
+extern unsigned long hal_hostRadioDrops; // frames lost because the radio was busy
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Arduino core, as far as the firmware uses it
+
+#define PROGMEM
+#define PSTR(s) (s)
+typedef const char* PGM_P;
+#define pgm_read_byte(p) (*(const byte*) (p))
+#define pgm_read_word(p) (*(const word*) (p))
+#define strcpy_P(d, s) strcpy(d, s)
+
+#define INPUT  0
+#define OUTPUT 1
+#define LOW    0
+#define HIGH   1
+#define A0     14
+#define A1     15
+
+#define bit(b)             (1UL << (b))
+#define bitRead(value, b)  (((value) >> (b)) & 1)
+
+static inline void pinMode(byte, byte) {}
+static inline void digitalWrite(byte, byte) {}
+int analogRead(byte pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+static inline void cli() {}
+static inline void sei() {}
+
+class HalSerial {
+public:
+	void begin(long) {}
+	int available();
+	int read();
+	void flush() {}
+	int availableForWrite();
+	size_t write(uint8_t c);
+	size_t write(const uint8_t* buf, size_t len);
+	size_t print(const char* s);
+	size_t print(char c);
+	size_t print(int n);
+	size_t print(unsigned int n);
+	size_t print(long n);
+	size_t print(unsigned long n);
+	size_t print(double n);
+	size_t println();
+	template <typename T> size_t println(T value) {
+		size_t n = print(value);
+		return n + println();
+	}
+};
+
+extern HalSerial Serial;
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// JeeLib, as far as the firmware uses it
+
+class MilliTimer {
+	word next;
+	byte armed;
+public:
+	MilliTimer () : armed (0) {}
+	byte poll(word ms =0);
+	word remaining() const;
+	byte idle() const { return !armed; }
+	void set(word ms);
+};
+
+class Sleepy {
+public:
+	static void powerDown() {}
+};
+
+#define RF12_HDR_CTL    0x80
+#define RF12_HDR_DST    0x40
+#define RF12_HDR_ACK    0x20
+#define RF12_HDR_MASK   0x1F
+
+#define RF12_WANTS_ACK  ((hal_radioHdr & RF12_HDR_ACK) && !(hal_radioHdr & RF12_HDR_CTL))
+#define RF12_ACK_REPLY  (hal_radioHdr & RF12_HDR_DST ? RF12_HDR_CTL : \
+                            RF12_HDR_CTL | RF12_HDR_DST | (hal_radioHdr & RF12_HDR_MASK))
+
+#define RF12_433MHZ     1
+#define RF12_868MHZ     2
+#define RF12_915MHZ     3
+#define RF12_SLEEP      0
+
+#define RF12_EEPROM_ADDR    ((uint8_t*) 0x20)
+#define RF12_EEPROM_SIZE    16
+#define RF12_EEPROM_VERSION 1
+
+byte rf12_configSilent();
+void rf12_configDump();
+byte rf12_initialize(byte id, byte band, byte group =0xD4, word frequency =1600);
+void rf12_sendNow(byte hdr, const void* ptr, byte len);
+static inline void rf12_onOff(byte) {}
+static inline void rf12_sleep(char) {}
+
+byte eeprom_read_byte(const uint8_t* addr);
+void eeprom_write_byte(uint8_t* addr, byte value);
+word _crc16_update(word crc, byte data);
+byte parity_even_bit(byte value);
+
+#endif
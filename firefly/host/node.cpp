@@ -0,0 +1,28 @@
+// Entry points of libwirefly.so, see wirefly_node.h
+
+#include "wirefly_node.h"
+
+void setup();
+void loop();
+int pattern_get();
+
+static const wirefly_node_api api = {
+	setup,
+	loop,
+	pattern_get,
+	hal_hostAttach,
+	hal_hostAdvance,
+	hal_hostDeliver,
+	hal_hostSerialInput,
+	hal_hostSetNoise,
+	wirefly_rxDrops,
+	hal_hostAsleep,
+	wirefly_powerCounters,
+	&hal_hostSerialEcho,
+	&hal_hostRadioDrops,
+};
+
+extern "C" __attribute__ ((visibility ("default")))
+const wirefly_node_api* wirefly_node() {
+	return &api;
+}
@@ -0,0 +1,137 @@
+// wirefly_bam: interrupt cost model for the bit angle modulation driver
+//
+// Works out the plane timing bam.h gives the driver at each refresh rate,
+// checks that every duty cycle comes out within rounding of its value, and
+// puts the plane interrupt's share of the CPU next to the share a plain
+// software PWM would take, one interrupt per count and a compare per
+// channel, for 12 to 24 channels. The cycle counts are estimates from the
+// AVR instruction timings of the code as written (-i, -w and -s to try
+// others), not measurements; the plane timing is exactly what the firmware
+// gets.
+//
+// usage: wirefly_bam [-i isr_cycles] [-w write_cycles] [-s softpwm_cycles,per_channel]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hal_linux.h"
+#include "../bam.h"
+
+// plane interrupt: response and reti 11, saving and restoring registers 32,
+// the call through the function pointer 15, 3 ports at 18 each, the next
+// plane's timing 20
+static unsigned long isr_cycles = 132;
+// bam_write(): call 20, then 8 planes at 10
+static unsigned long write_cycles = 100;
+// a software PWM interrupt: 50 fixed, and a compare and set per channel
+static unsigned long soft_cycles = 50, soft_channel = 6;
+
+static const unsigned long rates[] = { 100, 200, 400, 800, 1600 };
+static const int channels[] = { 12, 16, 20, 24 };
+
+#define NRATES    (sizeof rates / sizeof rates[0])
+#define NCHANNELS (sizeof channels / sizeof channels[0])
+
+// the plane timing at hz, as bam_timings[] has it in the firmware
+static void timing(unsigned long hz, byte select[8], word count[8], unsigned long cycles[8])
+{
+	for (byte b = 0; b < 8; ++b) {
+		select[b] = bam_select(hz, b);
+		count[b] = bam_count(hz, b);
+		cycles[b] = count[b] * bam_prescale(select[b]);
+	}
+}
+
+// the worst duty cycle error over every value, in 1/255 steps, from planes
+// built by bam_setPlanes() for a channel on each port
+static double dutyError(const unsigned long cycles[8])
+{
+	unsigned long total = 0;
+	for (byte b = 0; b < 8; ++b)
+		total += cycles[b];
+	double worst = 0;
+	for (int v = 0; v < 256; ++v) {
+		byte planes[8][BAM_PORTS] = {};
+		for (byte port = 0; port < BAM_PORTS; ++port) {
+			bam_pin pin = { port, (byte) (v % 8) };
+			bam_setPlanes(planes, pin, v);
+		}
+		for (byte port = 0; port < BAM_PORTS; ++port) {
+			unsigned long on = 0;
+			for (byte b = 0; b < 8; ++b)
+				if (planes[b][port] & (1 << (v % 8)))
+					on += cycles[b];
+			double err = (double) on * 255 / total - v;
+			if (err < 0)
+				err = -err;
+			if (err > worst)
+				worst = err;
+		}
+	}
+	return worst;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s [-i isr_cycles] [-w write_cycles] [-s softpwm_cycles,per_channel]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "i:w:s:")) != -1) {
+		switch (opt) {
+		case 'i':
+			isr_cycles = strtoul(optarg, 0, 10);
+			break;
+		case 'w':
+			write_cycles = strtoul(optarg, 0, 10);
+			break;
+		case 's':
+			if (sscanf(optarg, "%lu,%lu", &soft_cycles, &soft_channel) < 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	printf("plane timing at %lu MHz, interrupt %lu cycles\n", (unsigned long) F_CPU / 1000000, isr_cycles);
+	printf("%6s  %-46s  %8s  %6s  %s\n", "hz", "plane cycles (timer clock x counts)", "refresh", "error", "");
+	for (size_t r = 0; r < NRATES; ++r) {
+		byte select[8];
+		word count[8];
+		unsigned long cycles[8], total = 0;
+		timing(rates[r], select, count, cycles);
+		char planes[128];
+		int n = 0;
+		for (byte b = 0; b < 8; ++b) {
+			total += cycles[b];
+			n += snprintf(planes + n, sizeof planes - n, "%s%lu", b ? " " : "", cycles[b]);
+		}
+		printf("%6lu  %-46s  %7.1fHz  %5.2f   %s\n", rates[r], planes,
+			(double) F_CPU / total, dutyError(cycles),
+			cycles[0] > isr_cycles ? "" : "plane 0 shorter than the interrupt");
+	}
+
+	printf("\ncpu share: bam interrupt (any channel count) / bam_write() of every channel every tick / software pwm\n");
+	printf("%6s", "hz");
+	for (size_t c = 0; c < NCHANNELS; ++c)
+		printf("  %20d ch", channels[c]);
+	printf("\n");
+	for (size_t r = 0; r < NRATES; ++r) {
+		double bam = 100.0 * 8 * rates[r] * isr_cycles / F_CPU;
+		printf("%6lu", rates[r]);
+		for (size_t c = 0; c < NCHANNELS; ++c) {
+			double writes = 100.0 * channels[c] * write_cycles * HAL_TICK_HZ / F_CPU;
+			double soft = 100.0 * 256 * rates[r] * (soft_cycles + soft_channel * channels[c]) / F_CPU;
+			char cell[32];
+			snprintf(cell, sizeof cell, "%.1f/%.1f/%.0f%%", bam, writes, soft);
+			printf("  %23s", cell);
+		}
+		printf("\n");
+	}
+	return 0;
+}
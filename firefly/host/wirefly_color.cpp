@@ -0,0 +1,193 @@
+// wirefly_color: accuracy test and benchmark for WireflyColor.h
+//
+// Checks every fixed-point colour function against the same sum done in
+// double, over every input (all 16.7 million colours for luma), and fails
+// if any result is off by more than rounding. Then times each one against
+// its float version, the way the LED_MONO greyscale used to be done.
+// The timings are host cycles (TSC on x86, else nanoseconds), only good
+// for comparing the two; on an ATmega the float versions also go through
+// the soft-float library.
+//
+// usage: wirefly_color [-n iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <WireflyColor.h>
+
+static unsigned long long ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Float versions, as the firmware used to do them
+
+__attribute__((noinline)) static uint8_t float_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+	return 0.299 * r + 0.587 * g + 0.114 * b;
+}
+
+__attribute__((noinline)) static uint8_t float_scale(uint8_t v, uint8_t s)
+{
+	return v * (s / 255.0) + 0.5;
+}
+
+__attribute__((noinline)) static uint8_t float_blend(uint8_t a, uint8_t b, uint8_t frac)
+{
+	return a + (b - a) * (frac / 255.0) + (b >= a ? 0.5 : -0.5);
+}
+
+__attribute__((noinline)) static uint8_t fixed_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+	return color_luma(r, g, b);
+}
+
+__attribute__((noinline)) static uint8_t fixed_scale(uint8_t v, uint8_t s)
+{
+	return color_scale(v, s);
+}
+
+__attribute__((noinline)) static uint8_t fixed_blend(uint8_t a, uint8_t b, uint8_t frac)
+{
+	return color_blend(a, b, frac);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Accuracy
+
+static int failures;
+
+// report the worst error of one function; limit is what rounding allows
+static void check(const char* name, double worst, double limit)
+{
+	int ok = worst <= limit + 1e-9;
+	printf("%-18s max error %.3f  (limit %.3f)  %s\n", name, worst, limit, ok ? "ok" : "FAIL");
+	if (!ok)
+		++failures;
+}
+
+static void accuracy()
+{
+	double worst = 0;
+	for (int r = 0; r < 256; ++r)
+		for (int g = 0; g < 256; ++g)
+			for (int b = 0; b < 256; ++b) {
+				double e = fabs(color_luma(r, g, b) - (0.299 * r + 0.587 * g + 0.114 * b));
+				if (e > worst)
+					worst = e;
+			}
+	// the 8.8 weights are off by at most 0.18/256 each, plus rounding
+	check("color_luma", worst, 1.0);
+
+	worst = 0;
+	for (int v = 0; v < 256; ++v)
+		for (int s = 0; s < 256; ++s) {
+			double e = fabs(color_scale(v, s) - v * s / 255.0);
+			if (e > worst)
+				worst = e;
+		}
+	check("color_scale", worst, 0.5);
+
+	worst = 0;
+	for (int a = 0; a < 256; ++a)
+		for (int b = 0; b < 256; ++b) {
+			if (color_blend(a, b, 0) != a || color_blend(a, b, 255) != b)
+				worst = 256; // the ends must be exact
+			for (int f = 0; f < 256; ++f) {
+				double e = fabs(color_blend(a, b, f) - (a + (b - a) * f / 255.0));
+				if (e > worst)
+					worst = e;
+			}
+		}
+	check("color_blend", worst, 0.5);
+
+	worst = 0;
+	for (int v = 0; v < 256; ++v)
+		for (int s = 0; s < 256; ++s) {
+			double e = fabs(color_brightness(v, s) - fmin(255, v * s / 128.0));
+			if (e > worst)
+				worst = e;
+		}
+	check("color_brightness", worst, 0.5);
+
+	worst = 0;
+	for (unsigned c = 0; c < 0x8000; ++c) {
+		if (color15(color15_hi(c), color15_mid(c), color15_lo(c)) != c)
+			worst = 32;
+		uint16_t d = color15_scale(c, 128);
+		double e = fmax(fabs(color15_hi(d) - color15_hi(c) * 128 / 255.0),
+			fmax(fabs(color15_mid(d) - color15_mid(c) * 128 / 255.0),
+			fabs(color15_lo(d) - color15_lo(c) * 128 / 255.0)));
+		if (e > worst)
+			worst = e;
+	}
+	check("color15", worst, 0.5);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Speed
+
+static volatile uint8_t sink;
+
+#define BENCH(fn, n, ...) ({ \
+	unsigned long long t0 = ticks(); \
+	uint8_t acc = 0; \
+	for (unsigned long i = 0; i < (n); ++i) { \
+		uint8_t x = i, y = i >> 8, z = i >> 16; (void) z; \
+		acc += fn(__VA_ARGS__); \
+	} \
+	sink = acc; \
+	(double) (ticks() - t0) / (n); })
+
+static void speed(unsigned long n)
+{
+	printf("\n%-8s %10s %10s %8s\n", "", "fixed", "float", "ratio");
+	double a, b;
+	a = BENCH(fixed_luma, n, x, y, z);
+	b = BENCH(float_luma, n, x, y, z);
+	printf("%-8s %10.2f %10.2f %7.1fx\n", "luma", a, b, b / a);
+	a = BENCH(fixed_scale, n, x, y);
+	b = BENCH(float_scale, n, x, y);
+	printf("%-8s %10.2f %10.2f %7.1fx\n", "scale", a, b, b / a);
+	a = BENCH(fixed_blend, n, x, y, z);
+	b = BENCH(float_blend, n, x, y, z);
+	printf("%-8s %10.2f %10.2f %7.1fx\n", "blend", a, b, b / a);
+#if defined(__x86_64__) || defined(__i386__)
+	printf("(TSC ticks per call)\n");
+#else
+	printf("(ns per call)\n");
+#endif
+}
+
+int main(int argc, char** argv)
+{
+	unsigned long n = 10000000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, 0, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	accuracy();
+	speed(n);
+	return failures ? 1 : 0;
+}
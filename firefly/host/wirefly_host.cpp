@@ -0,0 +1,85 @@
+// wirefly_host: run one firefly node natively on Linux
+//
+// The node runs setup() and then loop() once per frame on the virtual clock,
+// which advances by a fixed frame time, so any length of simulated time runs
+// as fast as the host can compute it. Every PWM write and every radio frame
+// the node sends is printed with its virtual timestamp, and the loop() cost
+// in host time is reported at the end.
+//
+// usage: wirefly_host [-t seconds] [-f frame_us] [-q] [serial input]
+//   e.g. wirefly_host -t 60 3p    run PATTERN_FADER for a minute
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hal_linux.h"
+
+void setup();
+void loop();
+
+static byte quiet;
+
+static void onTransmit(void* ctx, byte hdr, const byte* data, byte len) {
+	if (quiet)
+		return;
+	printf("%lu tx %d", hal_millis(), hdr);
+	for (byte i = 0; i < len; ++i)
+		printf(" %d", data[i]);
+	printf("\n");
+}
+
+static void onPwm(void* ctx, byte pin, byte value) {
+	if (!quiet)
+		printf("%lu pwm %d %d\n", hal_millis(), pin, value);
+}
+
+static double elapsed_ns(const struct timespec& t0, const struct timespec& t1) {
+	return (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+}
+
+int main(int argc, char** argv) {
+	unsigned long seconds = 10;
+	unsigned long frame_us = 1000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:f:q")) != -1) {
+		switch (opt) {
+		case 't': seconds = strtoul(optarg, 0, 10); break;
+		case 'f': frame_us = strtoul(optarg, 0, 10); break;
+		case 'q': quiet = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-f frame_us] [-q] [serial input]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	hal_host_hooks hooks = { 0, onTransmit, 0, onPwm };
+	hal_hostAttach(&hooks);
+	hal_hostSerialEcho = !quiet;
+	hal_hostSetNoise(getpid() & 0x3FF);
+
+	setup();
+	for (int i = optind; i < argc; ++i) {
+		hal_hostSerialInput(argv[i]);
+		hal_hostSerialInput(" ");
+	}
+
+	unsigned long frames = 0;
+	unsigned long end_us = hal_micros() + seconds * 1000000UL;
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (hal_micros() < end_us) {
+		if (!hal_hostAsleep()) { // powered down, see hal_powerDown()
+			loop();
+			++frames;
+		}
+		hal_hostAdvance(frame_us);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fprintf(stderr, "%lu frames, %.0f ns per loop()\n",
+			frames, elapsed_ns(t0, t1) / frames);
+	return 0;
+}
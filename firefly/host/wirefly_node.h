@@ -0,0 +1,35 @@
+#ifndef __WIREFLY_NODE_H
+#define __WIREFLY_NODE_H
+
+// The firmware built as a shared object (libwirefly.so) for wirefly_sim.
+// Every dlopen()ed copy of the library is an independent node, with its own
+// firmware state, virtual clock and radio; wirefly_node() returns the entry
+// points of that copy.
+
+#include "hal_linux.h"
+#include "../firefly.h"
+
+typedef struct {
+	void (*setup)();
+	void (*loop)();
+	int  (*pattern_get)();
+
+	void (*attach)(const hal_host_hooks* hooks);
+	void (*advance)(unsigned long us);
+	byte (*deliver)(byte hdr, const byte* data, byte len);
+	void (*serialInput)(const char* s);
+	void (*setNoise)(int value);
+
+	word (*rxDrops)();
+	byte (*asleep)();
+	const wirefly_power* (*power)();
+
+	byte* serialEcho;
+	unsigned long* radioDrops;
+} wirefly_node_api;
+
+typedef const wirefly_node_api* (*wirefly_node_fn)();
+
+#define WIREFLY_NODE_ENTRY "wirefly_node"
+
+#endif
@@ -0,0 +1,197 @@
+// wirefly_random: test and benchmark for WireflyRandom.h
+//
+// Checks that rand_scale() takes exactly as many draws to every value of a
+// range, over all 65536 draws, for every range up to 4096 and a spread of
+// larger ones: rand_below() has no bias at all. Then puts a million draws
+// of rand_below() and rand_bits() through a chi-square test, checks that
+// nodes seeded with the same noise start out differently, and that every
+// steady reading of the seed pin gives a node a different seed, and times a
+// draw against the Park-Miller random() the Arduino core has. The timings
+// are host cycles (TSC on x86, else nanoseconds); a host divides in a few
+// cycles, an ATmega in hundreds, so the gap there is much wider.
+//
+// usage: wirefly_random [-n draws]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <WireflyRandom.h>
+
+static unsigned long long ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// the Arduino core's random(howbig), as hal_linux.cpp has it
+static long pm_seed = 1;
+
+__attribute__((noinline)) static long pm_random(long howbig)
+{
+	long hi = pm_seed / 127773L;
+	long lo = pm_seed % 127773L;
+	long x = 16807L * lo - 2836L * hi;
+	if (x < 0)
+		x += 0x7fffffffL;
+	pm_seed = x;
+	return (x % 0x7fffffffL) % howbig;
+}
+
+__attribute__((noinline)) static uint16_t fast_below(rand_state* s, uint16_t n)
+{
+	return rand_below(s, n);
+}
+
+__attribute__((noinline)) static uint8_t fast_bits(rand_state* s, uint8_t n)
+{
+	return rand_bits(s, n);
+}
+
+static int failed;
+
+// an analog pin that always reads the same
+static int steady;
+
+static int readSteady(uint8_t pin)
+{
+	return steady;
+}
+
+static int compareSeeds(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+// every value of 0 .. n - 1 gets the same number of the 65536 draws
+static void checkScale(uint16_t n)
+{
+	static unsigned counts[65536];
+	memset(counts, 0, n * sizeof counts[0]);
+	unsigned accepted = 0;
+	for (uint32_t r = 0; r < 65536; ++r) {
+		uint16_t v;
+		if (rand_scale(r, n, &v)) {
+			++counts[v];
+			++accepted;
+		}
+	}
+	unsigned each = 65536 / n;
+	for (uint32_t v = 0; v < n; ++v)
+		if (counts[v] != each) {
+			printf("rand_scale(%u): %u draws to %u, not %u\n", n, counts[v], v, each);
+			failed = 1;
+			return;
+		}
+	if (accepted != each * n) {
+		printf("rand_scale(%u): %u draws accepted, not %u\n", n, accepted, each * n);
+		failed = 1;
+	}
+}
+
+// chi-square of draws into n bins, as standard deviations from its mean
+static double chiSquare(const unsigned long* bins, unsigned n, unsigned long draws)
+{
+	double expect = (double) draws / n, chi = 0;
+	for (unsigned v = 0; v < n; ++v)
+		chi += (bins[v] - expect) * (bins[v] - expect) / expect;
+	return (chi - (n - 1)) / sqrt(2.0 * (n - 1));
+}
+
+int main(int argc, char** argv)
+{
+	unsigned long draws = 1000000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			draws = strtoul(optarg, 0, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n draws]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	unsigned ranges = 0;
+	for (uint32_t n = 1; n < 65536; n += n < 4096 ? 1 : 61, ++ranges)
+		checkScale(n);
+	checkScale(65535);
+	printf("rand_scale: %u ranges %s\n", ranges + 1, failed ? "FAIL" : "exactly uniform");
+
+	rand_state s;
+	rand_seed(&s, 1, 0);
+	static const uint16_t below[] = { 2, 30, 32, 64, 1000, 2001, 32768 };
+	static unsigned long bins[32768];
+	for (size_t k = 0; k < sizeof below / sizeof below[0]; ++k) {
+		uint16_t n = below[k];
+		memset(bins, 0, sizeof bins);
+		for (unsigned long i = 0; i < draws; ++i)
+			++bins[rand_below(&s, n)];
+		double z = chiSquare(bins, n, draws);
+		printf("rand_below(%5u): chi-square %+6.2f sd %s\n", n, z, fabs(z) < 5 ? "" : "FAIL");
+		failed |= fabs(z) >= 5;
+	}
+	for (uint8_t b = 1; b <= 8; ++b) {
+		memset(bins, 0, sizeof bins);
+		for (unsigned long i = 0; i < draws; ++i)
+			++bins[rand_bits(&s, b)];
+		double z = chiSquare(bins, 1 << b, draws);
+		printf("rand_bits(%u):       chi-square %+6.2f sd %s\n", b, z, fabs(z) < 5 ? "" : "FAIL");
+		failed |= fabs(z) >= 5;
+	}
+
+	// 31 nodes, the same noise: no two first draws alike
+	uint32_t first[32];
+	int same = 0;
+	for (uint8_t node = 1; node < 32; ++node) {
+		rand_seed(&s, node, 0x3FF);
+		first[node] = rand_next(&s);
+		for (uint8_t other = 1; other < node; ++other)
+			same += first[other] == first[node];
+	}
+	printf("rand_seed: 31 nodes, same noise, %d alike %s\n", same, same ? "FAIL" : "");
+	failed |= same != 0;
+
+	// one node, each of the 1024 steady readings: no two seeds alike
+	static uint32_t seeds[1024];
+	same = 0;
+	for (int v = 0; v < 1024; ++v) {
+		steady = v;
+		rand_seed(&s, 1, rand_noise(readSteady, 0));
+		seeds[v] = s.x;
+	}
+	qsort(seeds, 1024, sizeof seeds[0], compareSeeds);
+	for (int v = 1; v < 1024; ++v)
+		same += seeds[v] == seeds[v - 1];
+	printf("rand_noise: 1024 steady readings, %d seeds alike %s\n", same, same ? "FAIL" : "");
+	failed |= same != 0;
+
+	rand_seed(&s, 1, 0);
+	volatile unsigned long sink = 0;
+	unsigned long long t0 = ticks();
+	for (unsigned long i = 0; i < draws; ++i)
+		sink += pm_random(30);
+	unsigned long long t1 = ticks();
+	for (unsigned long i = 0; i < draws; ++i)
+		sink += fast_below(&s, 30);
+	unsigned long long t2 = ticks();
+	for (unsigned long i = 0; i < draws; ++i)
+		sink += fast_bits(&s, 1);
+	unsigned long long t3 = ticks();
+	printf("\nhost cycles a draw: random(30) %.1f, rand_below(30) %.1f, rand_bits(1) %.1f\n",
+		(double) (t1 - t0) / draws, (double) (t2 - t1) / draws, (double) (t3 - t2) / draws);
+	return failed;
+}
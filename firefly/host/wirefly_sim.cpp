@@ -0,0 +1,433 @@
+// wirefly_sim: many firefly nodes on one simulated RF12 channel
+//
+// Loads one copy of libwirefly.so per node, so every node runs the real
+// firmware with its own state, and steps them all on a shared timeline of
+// 1 ms frames. Each node's virtual clock runs fast or slow by its own skew.
+//
+// The channel models:
+//   airtime     every frame occupies the channel for its on-air length
+//   collisions  frames that overlap in time are lost to every receiver
+//   half duplex a node cannot hear while it is transmitting
+//   loss        each remaining reception is dropped with probability -l
+// hal_radioCanSend() fails while a frame is on the air (carrier sense), but
+// only once it has been on the air for CS_DELAY_US, so nodes that start
+// sending in the same frame collide.
+// Nodes are powered up at random points in the first -b seconds, so their
+// millis() clocks and broadcast timers disagree from the start.
+//
+// For every node count in the sweep it reports the time until all LEDs
+// blink in phase (and stay there), the phase error distribution at the end
+// of the run, and the total airtime spent getting there. "dropped" counts
+// frames a node missed on its own account: the radio was still holding the
+// last frame, or the firmware's receive ring was full.
+// "asleep" and "radio" are the share of the time since boot the nodes spent
+// powered down and with the receiver on, on average; -u ms duty cycles the
+// radio of every node (the firmware's 'u' command).
+// With -c seconds[,nodes], that many nodes (2 by default) are each given a
+// different pattern over serial at the same moment, and it also reports how
+// long it then takes until every node shows the same pattern (and stays so).
+//
+// usage: wirefly_sim [-n 2,5,10] [-t seconds] [-l loss] [-s skew_ppm]
+//                    [-b boot_spread_s] [-e tolerance_ms] [-p pattern]
+//                    [-c seconds[,nodes]] [-u listen_ms] [-r seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <libgen.h>
+#include <algorithm>
+#include <vector>
+
+#include "wirefly_node.h"
+
+#define FRAME_US        1000    // one loop() pass per node per frame
+#define EVAL_US         100000  // how often the phase error is evaluated
+#define RF12_BITRATE    49200   // JeeLib default, bits per second
+#define RF12_OVERHEAD   9       // preamble, sync, group, hdr, len, crc, tail
+#define CS_DELAY_US     500     // a frame only shows up in carrier sense after this
+#define LED_OFF         255     // MAX_RGB_VALUE, rgbSet() for dark
+#define REDPIN          5       // the channel whose blinks are timed
+
+typedef unsigned long long usec;
+
+struct Node {
+	int id;
+	void* dl;
+	const wirefly_node_api* api;
+	double rate;            // local clock speed, 1 + skew
+	double frac;            // sub-microsecond clock carry
+	usec tx_until;          // transmitting until then, can't receive
+	usec boot_at;           // powered up then, deaf and dark before
+	const char* cmd;        // serial input once booted: node id, pattern
+	byte booted;
+	byte led_on;
+	usec on_last, on_prev;  // the last two times the LED came on
+	unsigned long tx_frames;
+};
+
+struct Frame {
+	Node* src;
+	usec start, end;
+	byte collided;
+	byte hdr, len;
+	byte data[RF12_MAXDATA];
+};
+
+static struct {
+	usec now;
+	std::vector<Node*> nodes;
+	std::vector<Frame> air;
+	double loss;
+	unsigned long long rng;
+
+	unsigned long frames, collided, lost;
+	usec airtime;
+
+	usec cmd_at;            // when the conflicting commands go out, 0 = never
+	int commanders;         // how many nodes get one
+} sim;
+
+// the patterns the commanders are given, in turn: both blink red periodically,
+// so the phase error still means something afterwards
+static const char* conflict_patterns[] = { "4p", "5p" };
+
+static double uniform() {
+	// xorshift64*, deterministic per seed
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+	return (sim.rng * 2685821657736338717ULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static usec airtime(byte len) {
+	return (RF12_OVERHEAD + len) * 8ULL * 1000000ULL / RF12_BITRATE;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// radio hooks, called from inside the node that is currently running
+
+static void onTransmit(void* ctx, byte hdr, const byte* data, byte len) {
+	Node* n = (Node*) ctx;
+	Frame f;
+	f.src = n;
+	f.start = sim.now;
+	f.end = sim.now + airtime(len);
+	f.collided = 0;
+	f.hdr = hdr;
+	f.len = len;
+	memcpy(f.data, data, len);
+
+	for (size_t i = 0; i < sim.air.size(); ++i)
+		if (sim.air[i].end > f.start) {
+			sim.air[i].collided = 1;
+			f.collided = 1;
+		}
+	sim.air.push_back(f);
+
+	n->tx_until = f.end;
+	++n->tx_frames;
+	++sim.frames;
+	sim.airtime += f.end - f.start;
+}
+
+static byte onBusy(void* ctx) {
+	for (size_t i = 0; i < sim.air.size(); ++i)
+		if (sim.air[i].end > sim.now && sim.now - sim.air[i].start >= CS_DELAY_US)
+			return 1;
+	return 0;
+}
+
+static void onPwm(void* ctx, byte pin, byte value) {
+	Node* n = (Node*) ctx;
+	if (pin != REDPIN)
+		return; // one channel is enough to see where a node is in its cycle
+	byte on = value != LED_OFF;
+	if (on && !n->led_on) {
+		n->on_prev = n->on_last;
+		n->on_last = sim.now;
+	}
+	n->led_on = on;
+}
+
+// deliver every frame that has finished by now
+static void settle() {
+	size_t keep = 0;
+	for (size_t i = 0; i < sim.air.size(); ++i) {
+		Frame& f = sim.air[i];
+		if (f.end > sim.now) {
+			sim.air[keep++] = f;
+			continue;
+		}
+		if (f.collided) {
+			++sim.collided;
+			continue;
+		}
+		for (size_t j = 0; j < sim.nodes.size(); ++j) {
+			Node* r = sim.nodes[j];
+			if (r == f.src || !r->booted || r->tx_until > f.start)
+				continue;
+			if (uniform() < sim.loss) {
+				++sim.lost;
+				continue;
+			}
+			r->api->deliver(f.hdr, f.data, f.len);
+		}
+	}
+	sim.air.resize(keep);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// phase error
+
+// Phase error of each node's last LED-on edge against the circular mean of
+// all of them, in microseconds, using the median blink period. Returns false
+// until every node has blinked at least twice.
+static bool phaseErrors(std::vector<double>& err) {
+	std::vector<double> periods;
+	for (size_t i = 0; i < sim.nodes.size(); ++i) {
+		Node* n = sim.nodes[i];
+		if (!n->on_prev)
+			return false;
+		periods.push_back(n->on_last - n->on_prev);
+	}
+	std::sort(periods.begin(), periods.end());
+	double period = periods[periods.size() / 2];
+
+	double sx = 0, sy = 0;
+	for (size_t i = 0; i < sim.nodes.size(); ++i) {
+		double a = 2 * M_PI * fmod(sim.nodes[i]->on_last, period) / period;
+		sx += cos(a);
+		sy += sin(a);
+	}
+	double mean = atan2(sy, sx);
+
+	err.clear();
+	for (size_t i = 0; i < sim.nodes.size(); ++i) {
+		double a = 2 * M_PI * fmod(sim.nodes[i]->on_last, period) / period;
+		double d = remainder(a - mean, 2 * M_PI);
+		err.push_back(fabs(d) * period / (2 * M_PI));
+	}
+	std::sort(err.begin(), err.end());
+	return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static int listen_ms;   // -u, 0 = leave the radio on
+
+static void loadNodes(const char* lib, int count, double skew_ppm, double boot_s, const char* pattern) {
+	char dir[] = "/tmp/wirefly_sim.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	FILE* in = fopen(lib, "rb");
+	if (!in) {
+		perror(lib);
+		exit(1);
+	}
+	std::vector<char> image;
+	char buf[65536];
+	size_t got;
+	while ((got = fread(buf, 1, sizeof buf, in)) > 0)
+		image.insert(image.end(), buf, buf + got);
+	fclose(in);
+
+	for (int i = 0; i < count; ++i) {
+		// dlopen() hands out the same copy for the same path, so give every
+		// node a file of its own
+		char path[64];
+		snprintf(path, sizeof path, "%s/node%d.so", dir, i);
+		FILE* out = fopen(path, "wb");
+		fwrite(&image[0], 1, image.size(), out);
+		fclose(out);
+
+		Node* n = new Node();
+		n->id = i + 1;
+		n->dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		unlink(path);
+		if (!n->dl) {
+			fprintf(stderr, "%s\n", dlerror());
+			exit(1);
+		}
+		n->api = ((wirefly_node_fn) dlsym(n->dl, WIREFLY_NODE_ENTRY))();
+		n->rate = 1 + skew_ppm * 1e-6 * (2 * uniform() - 1);
+		n->led_on = 1; // so the first LED-on edge after setup() counts
+
+		hal_host_hooks hooks = { n, onTransmit, onBusy, onPwm };
+		n->api->attach(&hooks);
+		*n->api->serialEcho = 0;
+		n->api->setNoise((int) (uniform() * 1024));
+		n->boot_at = (usec) (uniform() * boot_s * 1e6);
+
+		char cmd[32];
+		snprintf(cmd, sizeof cmd, "%di%du%s", (i % 30) + 1, listen_ms, pattern);
+		n->cmd = strdup(cmd);
+		sim.nodes.push_back(n);
+	}
+	rmdir(dir);
+}
+
+static void unloadNodes() {
+	for (size_t i = 0; i < sim.nodes.size(); ++i) {
+		dlclose(sim.nodes[i]->dl);
+		free((void*) sim.nodes[i]->cmd);
+		delete sim.nodes[i];
+	}
+	sim.nodes.clear();
+	sim.air.clear();
+}
+
+static void run(const char* lib, int count, double seconds, double skew_ppm, double boot_s,
+				double tolerance_ms, const char* pattern) {
+	sim.now = 0;
+	sim.frames = sim.collided = sim.lost = 0;
+	sim.airtime = 0;
+	loadNodes(lib, count, skew_ppm, boot_s, pattern);
+
+	usec end = (usec) (seconds * 1e6);
+	usec synced_since = 0;
+	bool synced = false;
+	usec agreed_since = 0;
+	bool agreed = false;
+	std::vector<double> err;
+
+	for (unsigned long step = 0; sim.now < end; ++step) {
+		sim.now += FRAME_US;
+		settle();
+
+		// rotate who goes first, so no node always wins the channel
+		size_t first = step % sim.nodes.size();
+		for (size_t k = 0; k < sim.nodes.size(); ++k) {
+			Node* n = sim.nodes[(first + k) % sim.nodes.size()];
+			if (!n->booted) {
+				if (sim.now < n->boot_at)
+					continue;
+				n->api->setup();
+				n->api->serialInput(n->cmd);
+				n->booted = 1;
+			}
+			n->frac += FRAME_US * n->rate;
+			unsigned long us = (unsigned long) n->frac;
+			n->frac -= us;
+			n->api->advance(us);
+			if (!n->api->asleep())
+				n->api->loop();
+		}
+
+		if (sim.cmd_at && sim.now == sim.cmd_at)
+			for (int c = 0; c < sim.commanders; ++c) {
+				Node* n = sim.nodes[c * sim.nodes.size() / sim.commanders];
+				if (n->booted)
+					n->api->serialInput(conflict_patterns[c % 2]);
+			}
+
+		if (sim.now % EVAL_US == 0) {
+			bool now_synced = phaseErrors(err) && err.back() <= tolerance_ms * 1000;
+			if (now_synced && !synced)
+				synced_since = sim.now;
+			synced = now_synced;
+
+			if (sim.cmd_at && sim.now >= sim.cmd_at) {
+				bool now_agreed = true;
+				for (size_t i = 1; i < sim.nodes.size(); ++i)
+					if (sim.nodes[i]->api->pattern_get() != sim.nodes[0]->api->pattern_get())
+						now_agreed = false;
+				if (now_agreed && !agreed)
+					agreed_since = sim.now;
+				agreed = now_agreed;
+			}
+		}
+	}
+
+	unsigned long drops = 0;
+	double asleep = 0, radio = 0;
+	for (size_t i = 0; i < sim.nodes.size(); ++i) {
+		Node* n = sim.nodes[i];
+		drops += *n->api->radioDrops + n->api->rxDrops();
+		const wirefly_power* p = n->api->power();
+		double up_ms = (end - n->boot_at) / 1e3;
+		asleep += p->sleepMs / up_ms / sim.nodes.size();
+		radio += p->listenMs / up_ms / sim.nodes.size();
+	}
+
+	printf("%5d  ", count);
+	if (synced)
+		printf("%8.1f  ", synced_since / 1e6);
+	else
+		printf("%8s  ", "-");
+	if (phaseErrors(err))
+		printf("%7.1f %7.1f %7.1f  ",
+				err[err.size() / 2] / 1000, err[err.size() * 9 / 10] / 1000, err.back() / 1000);
+	else
+		printf("%7s %7s %7s  ", "-", "-", "-");
+	if (agreed)
+		printf("%8.1f  ", (agreed_since - sim.cmd_at) / 1e6);
+	else
+		printf("%8s  ", "-");
+	printf("%7lu %9.2f %6.2f%%  %6.2f%% %8lu %8lu  %6.1f%% %6.1f%%\n",
+			sim.frames, sim.airtime / 1e6, 100.0 * sim.airtime / end,
+			sim.frames ? 100.0 * sim.collided / sim.frames : 0.0, sim.lost, drops,
+			100 * asleep, 100 * radio);
+	fflush(stdout);
+
+	unloadNodes();
+}
+
+int main(int argc, char** argv) {
+	const char* sweep = "2,5,10,20,50,100,200";
+	double seconds = 300;
+	double skew_ppm = 100;
+	double boot_s = 10;
+	double tolerance_ms = 50;
+	const char* pattern = "10p"; // PATTERN_CLOCKSYNC
+	static char pattern_cmd[16];
+	int opt;
+
+	sim.loss = 0.05;
+	sim.rng = 0x5EED;
+
+	while ((opt = getopt(argc, argv, "n:t:l:s:b:e:p:c:u:r:")) != -1) {
+		switch (opt) {
+		case 'n': sweep = optarg; break;
+		case 't': seconds = atof(optarg); break;
+		case 'l': sim.loss = atof(optarg); break;
+		case 's': skew_ppm = atof(optarg); break;
+		case 'b': boot_s = atof(optarg); break;
+		case 'e': tolerance_ms = atof(optarg); break;
+		case 'p':
+			snprintf(pattern_cmd, sizeof pattern_cmd, "%sp", optarg);
+			pattern = pattern_cmd;
+			break;
+		case 'c':
+			sim.cmd_at = (usec) (atof(optarg) * 1e6) / EVAL_US * EVAL_US;
+			sim.commanders = strchr(optarg, ',') ? atoi(strchr(optarg, ',') + 1) : 2;
+			if (sim.commanders < 1)
+				sim.commanders = 1;
+			break;
+		case 'u': listen_ms = atoi(optarg); break;
+		case 'r': sim.rng = strtoull(optarg, 0, 0) | 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-n 2,5,10] [-t seconds] [-l loss] [-s skew_ppm]\n"
+					"          [-b boot_spread_s] [-e tolerance_ms] [-p pattern]\n"
+					"          [-c seconds[,nodes]] [-u listen_ms] [-r seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	char lib[4096];
+	snprintf(lib, sizeof lib, "%s/libwirefly.so", dirname(strdup(argv[0])));
+
+	printf("# %.0f s per run, loss %.0f%%, skew +-%.0f ppm, boot within %.0f s, in phase within %.0f ms\n",
+			seconds, sim.loss * 100, skew_ppm, boot_s, tolerance_ms);
+	printf("#nodes  sync(s)  err(ms) p50     p90     max  agree(s)  frames airtime(s)  util  collided   lost  dropped  asleep  radio\n");
+
+	char* list = strdup(sweep);
+	for (char* tok = strtok(list, ","); tok; tok = strtok(0, ","))
+		run(lib, atoi(tok), seconds, skew_ppm, boot_s, tolerance_ms, pattern);
+	return 0;
+}
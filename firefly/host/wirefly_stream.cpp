@@ -0,0 +1,231 @@
+// wirefly_stream: round trip test and link budget for WireflyStream.h
+//
+// Streams a few kinds of animation through stream_encode(), one part a
+// packet, and decodes every packet the way radio_led_client does, then
+// checks the receiver has every frame exactly. For each kind and strip
+// length it prints the packets and air bytes a frame takes, and the frames
+// a second that leaves room for on the RF12 link, next to the old ad hoc
+// format (a full packet of raw colours for every 30 pixels). With -l some
+// packets are lost, and the receiver's wrong pixels are counted instead;
+// a key frame goes out every -k frames.
+//
+// usage: wirefly_stream [-f frames] [-k keyframe_every] [-l loss_percent] [-s seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <WireflyColor.h>
+#include <WireflyStream.h>
+
+#define RF12_BITRATE   49200  // JeeLib default, bits per second
+#define RF12_OVERHEAD  9      // preamble, sync, group, hdr, len, crc, tail
+#define RF12_GAP_US    2000   // turnaround and carrier sense between packets
+#define PIXELS_MAX     240
+#define OLD_PIXELS     30     // pixels in an old ad hoc packet
+
+static int frames = 200;
+static int keyEvery = 16;
+static int lossPercent = 0;
+
+// the receiver, as radio_led_client has it
+static uint16_t rx[PIXELS_MAX];
+static stream_state rxState;
+static unsigned long rxShows;
+
+static void rx_set(uint8_t pixel, uint16_t color)
+{
+	rx[pixel] = color;
+}
+
+static void rx_packet(const uint8_t* part, uint8_t len, uint8_t count, int* bad)
+{
+	uint8_t what = stream_part(&rxState, part, len);
+	if (what & STREAM_DROP)
+		return;
+	if (what & STREAM_FLUSH)
+		++rxShows;
+	if (!stream_decode(part, len, rx_set, count))
+		++*bad;
+	if (what & STREAM_SHOW)
+		++rxShows;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Animations, frame f of count pixels
+
+static uint16_t random15()
+{
+	return rand() & 0x7FFF;
+}
+
+static uint16_t wheel(int pos)
+{
+	pos %= 96;
+	uint8_t k = pos % 32;
+	switch (pos / 32) {
+	case 0:
+		return color15(31 - k, k, 0);
+	case 1:
+		return color15(0, 31 - k, k);
+	default:
+		return color15(k, 0, 31 - k);
+	}
+}
+
+typedef struct {
+	const char* name;
+	void (*draw)(uint16_t* px, int count, int f);
+} animation;
+
+// a couple of pixels move, as in the twinkle or fireworks patterns
+static void drawSparse(uint16_t* px, int count, int f)
+{
+	for (int k = 0; k < 2; ++k)
+		px[rand() % count] = f & 1 ? 0 : random15();
+}
+
+// a tenth of the pixels get a new colour
+static void drawTenth(uint16_t* px, int count, int f)
+{
+	for (int k = 0; k < count / 10; ++k)
+		px[rand() % count] = random15();
+}
+
+// a tenth of the pixels change, between 4 colours
+static void drawFour(uint16_t* px, int count, int f)
+{
+	static const uint16_t four[4] = { 0, color15(31, 31, 0), color15(31, 16, 0), color15(0, 0, 31) };
+	for (int k = 0; k < count / 10 + 1; ++k)
+		px[rand() % count] = four[rand() % 4];
+}
+
+// a wipe: one colour, then the next
+static void drawWipe(uint16_t* px, int count, int f)
+{
+	int p = f % count;
+	px[p] = wheel(f / count * 32);
+}
+
+// rainbowCycle(), the wheel spread along the strip and turning
+static void drawRainbow(uint16_t* px, int count, int f)
+{
+	for (int p = 0; p < count; ++p)
+		px[p] = wheel(p * 96 / count + f);
+}
+
+// colorDoubleBuffer16(), every pixel one new colour
+static void drawFill(uint16_t* px, int count, int f)
+{
+	uint16_t c = random15();
+	for (int p = 0; p < count; ++p)
+		px[p] = c;
+}
+
+// noise, every pixel changes
+static void drawNoise(uint16_t* px, int count, int f)
+{
+	for (int p = 0; p < count; ++p)
+		px[p] = random15();
+}
+
+static const animation animations[] = {
+	{ "sparse", drawSparse },
+	{ "tenth", drawTenth },
+	{ "four", drawFour },
+	{ "wipe", drawWipe },
+	{ "rainbow", drawRainbow },
+	{ "fill", drawFill },
+	{ "noise", drawNoise },
+};
+
+static const int lengths[] = { 30, 60, 120, 240 };
+
+#define NANIMATIONS  (sizeof animations / sizeof animations[0])
+#define NLENGTHS     (sizeof lengths / sizeof lengths[0])
+
+// frames a second the link carries at packets and air bytes a frame
+static double rate(double packets, double bytes)
+{
+	return 1e6 / (bytes * 8e6 / RF12_BITRATE + packets * RF12_GAP_US);
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s [-f frames] [-k keyframe_every] [-l loss_percent] [-s seed]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	unsigned seed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:k:l:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			frames = atoi(optarg);
+			break;
+		case 'k':
+			keyEvery = atoi(optarg);
+			break;
+		case 'l':
+			lossPercent = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, 0, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (frames < 1 || keyEvery < 1)
+		usage(argv[0]);
+	srand(seed);
+
+	int failed = 0;
+	printf("%d frames, a key frame every %d, %d%% of packets lost, %d bps\n",
+		frames, keyEvery, lossPercent, RF12_BITRATE);
+	printf("%-8s %6s  %8s %8s %8s  %8s %8s  %8s\n", "", "pixels", "packets", "bytes", "frame/s",
+		"old pkts", "frame/s", lossPercent ? "wrong px" : "errors");
+	for (size_t a = 0; a < NANIMATIONS; ++a) {
+		for (size_t l = 0; l < NLENGTHS; ++l) {
+			int count = lengths[l];
+			uint16_t prev[PIXELS_MAX] = {}, next[PIXELS_MAX] = {};
+			memset(rx, 0, sizeof rx);
+			stream_reset(&rxState);
+			rxShows = 0;
+			unsigned long packets = 0, bytes = 0, wrong = 0;
+			int bad = 0;
+			for (int f = 0; f < frames; ++f) {
+				animations[a].draw(next, count, f);
+				const uint16_t* against = f % keyEvery ? prev : 0;
+				uint8_t first = 0;
+				do {
+					uint8_t part[STREAM_PART_MAX];
+					uint8_t len = stream_encode(against, next, count, f, &first, part, sizeof part);
+					++packets;
+					bytes += 1 + len + RF12_OVERHEAD; // the pattern byte, then the part
+					if (rand() % 100 >= lossPercent)
+						rx_packet(part, len, count, &bad);
+				} while (first < count);
+				for (int p = 0; p < count; ++p)
+					wrong += rx[p] != next[p];
+				memcpy(prev, next, sizeof prev);
+			}
+			int oldPackets = (count + OLD_PIXELS - 1) / OLD_PIXELS;
+			int oldBytes = oldPackets * (1 + 2 * OLD_PIXELS + RF12_OVERHEAD);
+			double pk = (double) packets / frames, by = (double) bytes / frames;
+			char result[32];
+			if (lossPercent)
+				snprintf(result, sizeof result, "%.2f", (double) wrong / frames);
+			else
+				snprintf(result, sizeof result, "%s", wrong || bad || rxShows != (unsigned long) frames ? "FAIL" : "ok");
+			if (bad || (!lossPercent && (wrong || rxShows != (unsigned long) frames)))
+				failed = 1;
+			printf("%-8s %6d  %8.2f %8.1f %8.1f  %8d %8.1f  %8s\n", animations[a].name, count,
+				pk, by, rate(pk, by), oldPackets, rate(oldPackets, oldBytes), result);
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,69 @@
+// wirefly_trace: turn a firefly serial capture back into a readable log
+//
+// Reads the raw serial stream (a file, or stdin) and prints ordinary text
+// as it is, and every binary trace record (see ../trace.h) as a line
+//   [time ms] name arguments
+// Record times are 16 bits of millis(); they are unwrapped into a running
+// time, so records more than 65 s apart lose the whole minutes between them.
+// Corrupt records (bad sum) are counted and skipped.
+//
+// usage: wirefly_trace [capture]
+//   e.g. wirefly_host -t 10 5p | wirefly_trace
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+#include "../trace.h"
+
+#define TRACE_NAME(id, name, format) name,
+#define TRACE_FORMAT(id, name, format) format,
+static const char* trace_names[] = { "none", TRACE_EVENTS(TRACE_NAME) };
+static const char* trace_formats[] = { "", TRACE_EVENTS(TRACE_FORMAT) };
+
+int main(int argc, char** argv)
+{
+	FILE* in = stdin;
+	if (argc > 2 || (argc == 2 && !(in = fopen(argv[1], "rb")))) {
+		fprintf(stderr, "usage: %s [capture]\n", argv[0]);
+		return 2;
+	}
+
+	unsigned long records = 0, corrupt = 0;
+	unsigned long long time = 0;  // unwrapped
+	int have_time = 0;
+	word last = 0;
+	int c;
+	while ((c = getc(in)) != EOF) {
+		if (c != TRACE_SYNC) {
+			putchar(c);
+			continue;
+		}
+		byte r[sizeof(trace_record) + 1];
+		if (fread(r, 1, sizeof r, in) != sizeof r)
+			break;
+		byte sum = 0;
+		for (unsigned i = 0; i < sizeof(trace_record); ++i)
+			sum += r[i];
+		if (sum != r[sizeof(trace_record)] || r[0] == TRACE_NONE || r[0] >= TRACE_EVENT_COUNT) {
+			++corrupt;
+			continue;
+		}
+
+		// little endian, as both the AVR and the host lay it out
+		word t = r[2] | (r[3] << 8);
+		word b = r[4] | (r[5] << 8);
+		word d = r[6] | (r[7] << 8);
+		time = have_time ? time + (word) (t - last) : t;
+		last = t;
+		have_time = 1;
+
+		printf("[%8llu] %-8s ", time, trace_names[r[0]]);
+		printf(trace_formats[r[0]], r[1], b, d);
+		putchar('\n');
+		++records;
+	}
+	fprintf(stderr, "%lu records, %lu corrupt\n", records, corrupt);
+	return 0;
+}
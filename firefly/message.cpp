@@ -0,0 +1,307 @@
+#include "hal.h"
+#include "firefly.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Batched network messages
+// A frame is WIREFLY_MSG_VERSION followed by records. A record starts with
+// one byte, type in the high nybble and length in the low one, then the
+// value; a length nybble of 15 means the real length follows in the next
+// byte. Short records, the common case, cost one byte of framing.
+// Records wait in the transmit queue until the channel is free, then
+// wirefly_send() packs as many as fit into one RF12 packet, so the preamble,
+// header and crc are paid once per frame rather than once per message.
+
+static byte msg_frame[RF12_MAXDATA];  // the outgoing frame
+static byte msg_len;                  // bytes used, 0 = empty
+
+// room for a record of len value bytes in the outgoing frame, or 0 if it
+// doesn't fit; the caller fills in the value
+byte* wirefly_msgAdd(byte type, byte len)
+{
+	if (msg_len == 0)
+		msg_frame[msg_len++] = WIREFLY_MSG_VERSION;
+	byte head = len < 15 ? 1 : 2;
+	if (msg_len + head + len > (int) sizeof msg_frame)
+		return 0;
+	if (len < 15)
+		msg_frame[msg_len++] = (type << 4) | len;
+	else {
+		msg_frame[msg_len++] = (type << 4) | 15;
+		msg_frame[msg_len++] = len;
+	}
+	byte* value = msg_frame + msg_len;
+	msg_len += len;
+	return value;
+}
+
+// the outgoing frame, and its length
+const byte* wirefly_msgFrame(byte* len)
+{
+	*len = msg_len;
+	return msg_frame;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Transmit queue
+// A few fixed slots, each holding one record and its priority, WIREFLY_PRIO_*.
+// wirefly_msgTake() packs the most urgent records first, oldest first within
+// a priority, so a sync ping never waits behind a pattern broadcast. Queueing
+// a type that is already waiting replaces it in place, as only the newest
+// pattern or ping is worth sending; when all slots are taken a more urgent
+// record evicts the least urgent one. ACKs go ahead of everything, in a frame
+// of their own addressed to the node that asked.
+
+#define MSG_SLOTS      4   // records waiting at most
+#define MSG_SLOT_DATA  12  // longest record value that can wait
+
+typedef struct
+{
+	byte type;   // 0 = free
+	byte prio;
+	byte seq;    // queueing order, for oldest first
+	byte len;
+	byte value[MSG_SLOT_DATA];
+} msg_slot;
+
+static msg_slot msg_slots[MSG_SLOTS];
+static byte msg_seq;
+static byte msg_ackHdr;    // header of the ACK to send
+static boolean msg_ack;    // an ACK is waiting
+
+// true if record a goes out before record b
+static boolean msg_sooner(const msg_slot* a, const msg_slot* b)
+{
+	if (a->prio != b->prio)
+		return a->prio < b->prio;
+	return (int8_t) (a->seq - b->seq) < 0;
+}
+
+// room for a record of len value bytes in the transmit queue, or 0 if there
+// isn't any; the caller fills in the value, which goes out with the next frame
+byte* wirefly_msgQueue(byte type, byte prio, byte len)
+{
+	if (len > MSG_SLOT_DATA)
+		return 0;
+
+	msg_slot* slot = 0;
+	for (byte i = 0; i < MSG_SLOTS; ++i) {
+		msg_slot* s = &msg_slots[i];
+		if (s->type == type) {
+			slot = s; // supersedes the one waiting
+			break;
+		}
+		if (!slot || (slot->type && (!s->type || msg_sooner(slot, s))))
+			slot = s; // a free slot, else the one that would go out last
+	}
+	if (slot->type && slot->type != type && slot->prio <= prio)
+		return 0; // full of records at least as urgent
+
+	slot->type = type;
+	slot->prio = prio;
+	slot->seq = msg_seq++;
+	slot->len = len;
+	return slot->value;
+}
+
+// drop a record of type still waiting in the queue, one that has become
+// redundant; returns true if there was one
+boolean wirefly_msgCancel(byte type)
+{
+	for (byte i = 0; i < MSG_SLOTS; ++i)
+		if (msg_slots[i].type == type) {
+			msg_slots[i].type = 0;
+			return true;
+		}
+	return false;
+}
+
+// the value of the first record of type in the outgoing frame, or 0; for
+// values filled in just before the frame goes on the air
+byte* wirefly_msgFind(byte type)
+{
+	wirefly_msgReader r;
+	const byte* value;
+	byte len, t;
+	if (!wirefly_msgBegin(&r, msg_frame, msg_len))
+		return 0;
+	while ((t = wirefly_msgNext(&r, &value, &len)) != 0)
+		if (t == type)
+			return (byte*) value;
+	return 0;
+}
+
+// send an ACK with header hdr (RF12_ACK_REPLY, worked out on receipt)
+void wirefly_msgAck(byte hdr)
+{
+	msg_ackHdr = hdr;
+	msg_ack = true;
+}
+
+// true if there is anything to send
+boolean wirefly_msgPending()
+{
+	if (msg_ack)
+		return true;
+	for (byte i = 0; i < MSG_SLOTS; ++i)
+		if (msg_slots[i].type)
+			return true;
+	return false;
+}
+
+// the waiting ACK header, if there is one
+boolean wirefly_msgTakeAck(byte* hdr)
+{
+	if (!msg_ack)
+		return false;
+	msg_ack = false;
+	*hdr = msg_ackHdr;
+	return true;
+}
+
+// start a new outgoing frame and move queued records into it, most urgent
+// first, as far as they fit; returns a bit mask of the record types taken
+word wirefly_msgTake()
+{
+	word types = 0;
+	msg_len = 0;
+	for (;;) {
+		msg_slot* next = 0;
+		for (byte i = 0; i < MSG_SLOTS; ++i) {
+			msg_slot* s = &msg_slots[i];
+			if (s->type && (!next || msg_sooner(s, next)))
+				next = s;
+		}
+		if (!next)
+			break;
+		byte* value = wirefly_msgAdd(next->type, next->len);
+		if (!value)
+			break; // the rest waits for the next frame
+		memcpy(value, next->value, next->len);
+		types |= 1 << next->type;
+		next->type = 0;
+	}
+	return types;
+}
+
+// start reading a received frame in place; false if it isn't one of ours
+boolean wirefly_msgBegin(wirefly_msgReader* r, const volatile byte* data, byte len)
+{
+	if (len < 1 || data[0] != WIREFLY_MSG_VERSION)
+		return false;
+	r->next = (const byte*) data + 1;
+	r->end = (const byte*) data + len;
+	return true;
+}
+
+// the next record of the frame: returns its type and points value at its
+// value bytes, still in the receive buffer; returns 0 at the end of the
+// frame, or at a record that runs past it
+byte wirefly_msgNext(wirefly_msgReader* r, const byte** value, byte* len)
+{
+	if (r->end - r->next < 1)
+		return 0;
+	byte type = r->next[0] >> 4;
+	byte head = 1;
+	*len = r->next[0] & 0xF;
+	if (*len == 15) {
+		if (r->end - r->next < 2)
+			return 0;
+		*len = r->next[1];
+		head = 2;
+	}
+	if (r->end - r->next - head < *len)
+		return 0;
+	*value = r->next + head;
+	r->next += head + *len;
+	return type;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Receive ring
+// wirefly_recvDone() copies every good frame in here the moment the driver
+// hands it over, and the radio goes straight back to listening; the frames
+// are dispatched later, from wirefly_interrupt(). A frame that arrives with
+// the ring full is dropped and counted.
+
+#define MSG_RX_FRAMES  3
+
+typedef struct
+{
+	byte hdr, len;
+	unsigned long at;  // hal_micros() on arrival
+	byte data[RF12_MAXDATA];
+} msg_rxFrame;
+
+static msg_rxFrame msg_rx[MSG_RX_FRAMES];
+static byte msg_rxHead, msg_rxCount;
+static word msg_rxDrops;
+static unsigned long msg_rxAt;  // arrival of the frame being dispatched
+
+// keep a received frame for dispatch; false if the ring is full
+boolean wirefly_rxPush(byte hdr, const volatile byte* data, byte len)
+{
+	if (msg_rxCount >= MSG_RX_FRAMES) {
+		if (msg_rxDrops < 0xFFFF)
+			++msg_rxDrops;
+		return false;
+	}
+	msg_rxFrame* f = &msg_rx[(msg_rxHead + msg_rxCount) % MSG_RX_FRAMES];
+	if (len > sizeof f->data)
+		len = sizeof f->data;
+	f->hdr = hdr;
+	f->len = len;
+	f->at = hal_micros();
+	for (byte i = 0; i < len; ++i)
+		f->data[i] = data[i];
+	++msg_rxCount;
+	return true;
+}
+
+// frames dropped because the ring was full, since power up
+word wirefly_rxDrops()
+{
+	return msg_rxDrops;
+}
+
+// when the frame whose records are being dispatched came in, by hal_micros()
+unsigned long wirefly_rxTime()
+{
+	return msg_rxAt;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Dispatch
+// One handler per record type, registered with wirefly_subscribe().
+// wirefly_dispatch() walks every frame in the ring, in place, and hands each
+// record to the handler of its type; records nobody subscribed to are skipped.
+
+static wirefly_handler msg_handlers[16];
+
+// have fn called with every record of this type that arrives (0 to stop)
+void wirefly_subscribe(byte type, wirefly_handler fn)
+{
+	msg_handlers[type & 0xF] = fn;
+}
+
+// hand the records of all received frames to their handlers
+// returns the number of frames dispatched
+byte wirefly_dispatch()
+{
+	byte frames = 0;
+	while (msg_rxCount) {
+		msg_rxFrame* f = &msg_rx[msg_rxHead];
+		wirefly_msgReader msg;
+		const byte* value;
+		byte type, len;
+		msg_rxAt = f->at;
+		if (wirefly_msgBegin(&msg, f->data, f->len))
+			while ((type = wirefly_msgNext(&msg, &value, &len)))
+				if (msg_handlers[type])
+					msg_handlers[type](f->hdr & RF12_HDR_MASK, value, len);
+		msg_rxHead = (msg_rxHead + 1) % MSG_RX_FRAMES;
+		--msg_rxCount;
+		++frames;
+	}
+	return frames;
+}
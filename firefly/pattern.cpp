@@ -1,22 +1,17 @@
-#include <JeeLib.h>
-#include <util/crc16.h>
-#include <avr/eeprom.h>
-#include <avr/pgmspace.h>
-#include <util/parity.h>
-
-#include "Arduino.h"
+#include "hal.h"
 #include "firefly.h"
-#include "aprintf.h"
+#include <WireflyColor.h>
 
 static uint8_t wirefly_pattern = 0;
+static uint8_t pattern_active = 0xFF; // the pattern pattern_run() last ticked, 0xFF = none yet
 
 
-void pattern_testLED();
-void pattern_randomTwinkle();
-void pattern_teamFirefly();
-void pattern_clockSync();
-void pattern_rgbFader();
-void pattern_rgbpulse();
+void pattern_testLED(unsigned long now);
+void pattern_randomTwinkle(unsigned long now);
+void pattern_teamFirefly(unsigned long now);
+void pattern_clockSync(unsigned long now);
+void pattern_rgbFader(unsigned long now);
+void pattern_rgbpulse(unsigned long now);
 
 
 void pattern_set(int value)
@@ -32,34 +27,87 @@ int pattern_get()
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // Control functions for patterns
 
+// Patterns are resumable state machines: pattern_run() ticks the active pattern
+// once per loop() pass and the pattern must return promptly, so the radio and
+// serial get serviced on every frame. Anything that used to live on the stack
+// of a pattern's while(true) loop lives in pattern_state instead.
+// step 0 is always the entry step; pattern_run() resets the state whenever the
+// pattern changes, so a new pattern takes effect on the very next frame.
+typedef struct
+{
+	byte step;            // 0 = just entered, pattern-specific after that
+	int  i;               // pattern-specific loop counter
+	unsigned long mark;   // millis() at which the current step began
+	unsigned long wait;   // how long the current step lasts, in milliseconds
+} pattern_state_t;
+
+static pattern_state_t pattern_state;
+
+// start the next step of the sequence, lasting wait milliseconds
+static void pattern_wait(unsigned long now, unsigned long wait)
+{
+	pattern_state.mark = now;
+	pattern_state.wait = wait;
+}
+
+// true once the current step has lasted its wait time (rollover proof)
+static boolean pattern_due(unsigned long now)
+{
+	return (now - pattern_state.mark) >= pattern_state.wait;
+}
+
+// Patterns drawn from network_millis() are a pure function of network time, so
+// every lantern shows the same colour at the same moment whenever it joined.
+// pattern_frame() takes the frame number the pattern computed from network
+// time and is true only when it differs from the one drawn last, so the LEDs
+// are written once per change rather than on every pass.
+static boolean pattern_frame(unsigned long frame)
+{
+	if (pattern_state.step != 0 && frame == pattern_state.mark)
+		return false;
+	pattern_state.step = 1;
+	pattern_state.mark = frame;
+	return true;
+}
+
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // runPattern()
-// Pattern control switch!
+// Pattern control switch! Called once per loop() pass.
 void pattern_run() {
+	unsigned long now = hal_millis();
+
+	if (wirefly_pattern != pattern_active) {
+		pattern_active = wirefly_pattern;
+		memset(&pattern_state, 0, sizeof pattern_state);
+	}
+
 	// Update this switch if adding a pattern! (primitive callback)
 	switch (wirefly_pattern) {
 	default:
 	case PATTERN_OFF:
-		pattern_off();  // all lights off, including/especially the lantern
+		pattern_off(now);  // all lights off, including/especially the lantern
 		break;
 	case PATTERN_RGBTEST:
-		pattern_testLED();
+		pattern_testLED(now);
 		break;
 	case PATTERN_TWINKLE:
-		pattern_randomTwinkle(); //blinks randomly at full intensity
+		pattern_randomTwinkle(now); //blinks randomly at full intensity
 		break;
 	case PATTERN_FIREFLY:
-		pattern_teamFirefly(); // slowly beginning to blink together, timed tx/rx
+		pattern_teamFirefly(now); // slowly beginning to blink together, timed tx/rx
 		break;
 	case PATTERN_CLOCKSYNC:
-		pattern_clockSync();  // synchronizing firefly lanterns
+		pattern_clockSync(now);  // synchronizing firefly lanterns
 		break;
 	case PATTERN_FADER:
-		pattern_rgbFader(); // rgb fading in 3-space. matrix math is fun
+		pattern_rgbFader(now); // rgb fading in 3-space. matrix math is fun
 		break;
 	case PATTERN_PULSER:
-		pattern_rgbpulse(); // more primitive rgb fader
+		pattern_rgbpulse(now); // more primitive rgb fader
 	}
+#ifdef LED_ADDR
+	strip_show(); // the frame, in one go
+#endif
 }
 
 /*
@@ -101,33 +149,239 @@ unsigned int Wheel(byte WheelPos)
   return(Color(r,g,b));
 }
  */
-  static void rgbSet(byte r, byte g, byte b)
-  {
-#ifdef SERIAL_DEBUG
-        aprintf("rgbset %d %d %d\n", r, g, b);
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Tables worked out by the compiler
+// index_count<N>::seq is index_seq<0, 1, ..., N-1>, to expand a constexpr
+// function over a table's indices.
+template <int... I> struct index_seq {};
+template <int N, int... I> struct index_count : index_count<N - 1, N - 1, I...> {};
+template <int... I> struct index_count<0, I...> { typedef index_seq<I...> seq; };
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// LED output stage
+// Patterns call rgbSet() with values 0 (brightest) to 255 (dark), as before.
+// Each channel goes through a gamma table, so equal steps look equal to the
+// eye, then into its calibrated window, CHANNEL_MIN_VALUE (brightest) to
+// CHANNEL_MAX_VALUE (dimmest lit), so the low end of a fade isn't lost below
+// the LED's ON threshold. Dark is always 255, fully off.
+// The last value written to each pin is kept, and unchanged pins are skipped.
+
+// brightness i of 255, gamma about 2.2 (0.8 x^2 + 0.2 x^3); lit stays lit
+static constexpr byte gamma_level(long i)
+{
+	return i && (4 * i * i + i * i * i / 255 + 637) / 1275 == 0 ? 1 :
+		(4 * i * i + i * i * i / 255 + 637) / 1275;
+}
+
+template <typename S> struct gamma_table;
+template <int... I> struct gamma_table<index_seq<I...> > {
+	static const byte levels[sizeof...(I)];
+};
+template <int... I>
+const byte gamma_table<index_seq<I...> >::levels[sizeof...(I)] PROGMEM = { gamma_level(I)... };
+
+typedef gamma_table<index_count<256>::seq> rgb_gamma;
+
+// the window of each channel, red, green, blue (or mono), and its width
+// over 255, 0.16 fixed point
+static constexpr word rgb_spanOf(byte min, byte max)
+{
+	return ((unsigned long) (max - min) << 16) / 255;
+}
+
+static const byte rgb_min[3] = { RED_MIN_VALUE, GREEN_MIN_VALUE, BLUE_MIN_VALUE };
+static const byte rgb_max[3] = { RED_MAX_VALUE, GREEN_MAX_VALUE, BLUE_MAX_VALUE };
+static const word rgb_span[3] = {
+	rgb_spanOf(RED_MIN_VALUE, RED_MAX_VALUE),
+	rgb_spanOf(GREEN_MIN_VALUE, GREEN_MAX_VALUE),
+	rgb_spanOf(BLUE_MIN_VALUE, BLUE_MAX_VALUE),
+};
+
+// the outputs: BAM_CHANNELS port pins, three per firefly (bam.h), a strip
+// (strip.h), or the hardware PWM pins of the one LED
+#if defined(LED_BAM)
+#define RGB_CHANNELS  BAM_CHANNELS
+#define rgbPin(ch, pwm)  bam_write(ch, pwm)
+#elif defined(LED_ADDR)
+#define RGB_CHANNELS  (3 * STRIP_LEDS)
+#define rgbPin(ch, pwm)  strip_write(ch, 255 - (pwm))
+#else
+#if defined(LED_RGB)
+static const byte rgb_pins[] = { REDPIN, GREENPIN, BLUEPIN };
+#elif defined(LED_MONO)
+static const byte rgb_pins[] = { LEDPIN };
+#endif
+#define RGB_CHANNELS  (sizeof rgb_pins)
+#define rgbPin(ch, pwm)  hal_pwmWrite(rgb_pins[ch], pwm)
 #endif
-#ifdef LED_RGB
-	analogWrite(REDPIN, r);
-	analogWrite(GREENPIN, g);
-	analogWrite(BLUEPIN, b);
+// a strip isn't refreshed often enough to dither
+#ifndef LED_ADDR
+#define RGB_DITHER
 #endif
+
 #ifdef LED_MONO
-        //greyscale approximation
-        byte x = 0.299*r + 0.587*g + 0.114*b;
-        analogWrite(LEDPIN, x);
+#define RGB_LEDS  RGB_CHANNELS
+#else
+#define RGB_LEDS  (RGB_CHANNELS / 3)
 #endif
+
+// pwm value, 8.8, for brightness level, 8.16, of channel ch (red, green,
+// blue in turn): gamma is read between table entries, so the fraction
+// survives into the window
+static word rgbPwm(byte ch, unsigned long level)
+{
+	byte i = level >> 16;
+	byte frac = level >> 8;
+	byte lo = pgm_read_byte(&rgb_gamma::levels[i]);
+	word g = (word) lo << 8;
+	if (i < 255)
+		g += (pgm_read_byte(&rgb_gamma::levels[i + 1]) - lo) * frac;
+	byte k = ch % 3;
+	return ((word) rgb_max[k] << 8) - (((unsigned long) g * rgb_span[k] + 0x8000) >> 16);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Fade engine
+// rgbFade() hands every channel a keyframe, the value to reach and the ms to
+// reach it in, and rgbTick(), run HAL_TICK_HZ times a second by the HAL (a
+// timer interrupt on the JeeNode), moves it there a step per tick however
+// busy loop() is with the radio. Levels are kept to 1/65536 of a step. The
+// 8 bits of pwm fraction left after gamma and the window are dithered in
+// time: what is left over carries into the next tick, so the pin alternates
+// between neighbouring values in the right proportion, which gives levels
+// in between analogWrite()'s, most welcome at the dim end of the window.
+// Dark, below brightness 1, is 255 exactly; lit never dithers up to it.
+// A channel resting on a whole pwm value costs the tick nothing.
+
+typedef struct
+{
+	unsigned long level;  // brightness (255 - value), 8.16
+	long step;            // added to level every tick
+	word ticks;           // left until the keyframe
+	byte target;          // brightness at the keyframe
+	byte frac;            // pwm fraction of level, 0 = whole
+	byte dither;          // pwm fraction carried over
+	int pwm;              // last written, -1 = never
+} rgb_channel;
+
+static volatile rgb_channel rgb_channels[RGB_CHANNELS];
+
+// drive channel ch at its level; interrupts off, or from the tick
+static void rgbOutput(byte ch)
+{
+	volatile rgb_channel* c = &rgb_channels[ch];
+	byte pwm = 255;
+	if (c->level >> 16) {
+		word v = rgbPwm(ch, c->level);
+#ifdef RGB_DITHER
+		c->frac = v;
+		v += c->dither;
+		c->dither = v;
+#else
+		v = v < 0xFF80 ? v + 0x80 : 0xFFFF;
+#endif
+		pwm = v >> 8 < 255 ? v >> 8 : 254;
+	} else
+		c->frac = c->dither = 0;
+	if (pwm == c->pwm)
+		return;
+	c->pwm = pwm;
+	rgbPin(ch, pwm);
+}
+
+// one step of every channel, from the HAL tick
+static void rgbTick()
+{
+	for (byte ch = 0; ch < RGB_CHANNELS; ++ch) {
+		volatile rgb_channel* c = &rgb_channels[ch];
+		if (c->ticks) {
+			if (--c->ticks)
+				c->level += c->step;
+			else
+				c->level = (unsigned long) c->target << 16;
+		} else if (!c->frac)
+			continue;
+		rgbOutput(ch);
+	}
+}
+
+// fade channel ch from where it is now to value over ms, 0 = at once
+static void rgbFadeChannel(byte ch, byte value, word ms)
+{
+	volatile rgb_channel* c = &rgb_channels[ch];
+	byte target = 255 - value;
+	word ticks = (unsigned long) ms * HAL_TICK_HZ / 1000;
+	long step = 0;
+	if (ticks) {
+		// the division stays outside the lock; should the tick move the level
+		// meanwhile, the keyframe still lands exactly on the last one
+		cli();
+		unsigned long level = c->level;
+		sei();
+		step = (((long) target << 16) - (long) level) / ticks;
+	}
+	cli();
+	c->target = target;
+	c->step = step;
+	c->ticks = ticks;
+	if (!ticks) {
+		c->level = (unsigned long) target << 16;
+		rgbOutput(ch);
+	}
+	sei();
+}
+
+// fade firefly led, 0 to RGB_LEDS - 1, to r, g, b over ms, 0 = at once
+static void rgbFadeLed(byte led, byte r, byte g, byte b, word ms)
+{
+#ifdef LED_MONO
+	//greyscale approximation
+	rgbFadeChannel(led, color_luma(r, g, b), ms);
+#else
+	rgbFadeChannel(3 * led, r, ms);
+	rgbFadeChannel(3 * led + 1, g, ms);
+	rgbFadeChannel(3 * led + 2, b, ms);
+#endif
+}
+
+// fade every firefly to r, g, b over ms, 0 = at once
+static void rgbFade(byte r, byte g, byte b, word ms)
+{
+	TRACE(TRACE_RGBSET, r, g, b);
+	for (byte led = 0; led < RGB_LEDS; ++led)
+		rgbFadeLed(led, r, g, b, ms);
+}
+
+  static void rgbSet(byte r, byte g, byte b)
+  {
+	rgbFade(r, g, b, 0);
   }
 
+// start the outputs, and the tick that drives the fade engine
+void pattern_begin()
+{
+	for (byte ch = 0; ch < RGB_CHANNELS; ++ch)
+		rgb_channels[ch].pwm = -1;
+#ifdef LED_BAM
+	bam_begin();
+#endif
+#ifdef LED_ADDR
+	strip_begin();
+#endif
+	hal_tickBegin(rgbTick);
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // PATTERN functions begin here
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // PATTERN_OFF: No color value, clear LEDs
-void pattern_off() {
-	rgbSet(MAX_RGB_VALUE, MAX_RGB_VALUE, MAX_RGB_VALUE);
-	while (1)
-		if (wirefly_interrupt()) return;
+void pattern_off(unsigned long now) {
+	if (pattern_state.step == 0) {
+		rgbSet(MAX_RGB_VALUE, MAX_RGB_VALUE, MAX_RGB_VALUE);
+		pattern_state.step = 1;
+	}
 }
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
@@ -161,51 +415,40 @@ void pattern_luxMeter() {
  */
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // PATTERN_TWINKLE:
-void pattern_randomTwinkle() {
+// step 1 = lantern off, step 2 = lantern on
+void pattern_randomTwinkle(unsigned long now) {
+	if (pattern_state.step == 0) {
 #ifdef SERIAL_DEBUG
-	Serial.println("pattern_randomTwinkle()");
+		Serial.println("pattern_randomTwinkle()");
 #endif
-	int lantern_on = 0; // LED 1 = enabled, 0 = disabled
-	int wait_millis = 0; // time to stay either on or off
-	unsigned long clock_elapsed = 0; // counting how long it's been on or off
-
-	unsigned long clock_current = 0; //this variable will be updated each iteration of loop
-	unsigned long clock_recent = 0; //no time has passed yet
-
-	while (true) {
-		clock_recent = clock_current; //save clock_current from the previous loop() to clock_recent
-		clock_current = millis(); //update to "now"
-
-		//this is roll-over proof, if clock_current is small, and clock_recent large,
-		//the result rolls over to a small positive value:
-		clock_elapsed = clock_elapsed + (clock_current - clock_recent);
-
-		//        debounceInputs();
-
-		if (clock_elapsed >= wait_millis) { //time to switch
-			if (lantern_on == 1) { // previously on
-				wait_millis = random(1500, 6999); // time to stay off
-				rgbSet(MAX_RGB_VALUE, MAX_RGB_VALUE, MAX_RGB_VALUE);
-				lantern_on = 0;
-			}
-			else { //the light was previously turned off
-				wait_millis = random(500, 900); // time to stay on
-				rgbSet(23, 23, 23);
-				lantern_on = 1;
-			}
-			clock_elapsed = 0; //reset
-		}
-		//check with the outside world:
-		if (wirefly_interrupt()) return;
+		pattern_state.step = 1; // start off, and switch on straight away
+		pattern_wait(now, 0);
+	}
+
+	if (!pattern_due(now))
+		return;
+
+	if (pattern_state.step == 2) { // previously on
+		rgbSet(MAX_RGB_VALUE, MAX_RGB_VALUE, MAX_RGB_VALUE);
+		pattern_state.step = 1;
+		pattern_wait(now, wirefly_randomRange(1500, 6999)); // time to stay off
+	}
+	else { //the light was previously turned off
+		rgbSet(23, 23, 23);
+		pattern_state.step = 2;
+		pattern_wait(now, wirefly_randomRange(500, 900)); // time to stay on
 	}
 }
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // PATTERN_FIREFLY:
-void pattern_teamFirefly() {
+void pattern_teamFirefly(unsigned long now) {
+	if (pattern_state.step == 0) {
 #ifdef SERIAL_DEBUG
-	Serial.println("pattern_teamFirefly()");
+		Serial.println("pattern_teamFirefly()");
 #endif
+		pattern_state.step = 1;
+	}
 
 	/*
 MilliTimer g_sendTimer;
@@ -214,9 +457,6 @@ byte g_needToSend;
     if (g_sendTimer.poll(3000)) // 3 seconds
         g_needToSend = 1;
 	 */
-
-	//check with the outside world:
-	if (wirefly_interrupt()) return;
 }
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
@@ -234,11 +474,13 @@ byte g_needToSend;
  */
 
 // Slowing things down we need...
-#define  FADE_TRANSITION_DELAY  70   // in milliseconds, between individual light changes
+#define  FADE_TRANSITION_DELAY  70   // in milliseconds, per unit of colour change
 #define  FADE_WAIT_DELAY        500  // in milliseconds, at the end of each traverse
 //
 // Total traversal time is ((MAX_RGB_VALUE - MIN_RGB_VALUE) * TRANSITION_DELAY) + WAIT_DELAY
-// eg, ((255-0)*70)+500 = 18350ms = 18.35s
+// eg, ((255-10)*70)+500 = 17650ms = 17.65s
+// Only the time matters: the colour is interpolated afresh on every pass, so
+// the fade is as smooth as the frame rate allows, at any speed.
 
 // Structure to contain a 3D coordinate
 typedef struct
@@ -246,8 +488,6 @@ typedef struct
 	byte  x, y, z;
 } coord;
 
-static coord v; // the current rgb coordinates (colour) being displayed
-
 //The RGB colour space can be visualised as a cube whose (x, y, z) coordinates range from (0, 0, 0) 
 //  or white, to (255, 255, 255) or black. 
 //More generally the cube is defined in the 3D space (0,0,0) to (1,1,1), scaled by 255. 
@@ -265,7 +505,7 @@ static coord v; // the current rgb coordinates (colour) being displayed
   A+---------+E      +--->x
 
  */
-const coord vertex[] = 
+static constexpr coord vertex[] =
 {
 		//x  y  z      name
 		{0, 0, 0}, // A or 0
@@ -284,7 +524,7 @@ const coord vertex[] =
  representation as decimal, so bytes 0x12, 0x34 ... should be interpreted as vertex 1 to 
  v2 to v3 to v4 (ie, one continuous path B to C to D to E).
  */
-const byte path[] =
+static constexpr byte path[] =
 {
 		0x01, 0x23, 0x76, 0x54, 0x03, 0x21, 0x56, 0x74,  // trace the edges
 		0x13, 0x64, 0x16, 0x02, 0x75, 0x24, 0x35, 0x17, 0x25, 0x70,  // do the diagonals
@@ -292,256 +532,325 @@ const byte path[] =
 
 #define  MAX_PATH_SIZE  (sizeof(path)/sizeof(path[0]))  // size of the array
 
-int traverse(int dx, int dy, int dz)
-// Move along the colour line from where we are to the next vertex of the cube.
-// The transition is achieved by applying the 'delta' value to the coordinate.
-// By definition all the coordinates will complete the transition at the same 
-// time as we only have one loop index.
+// the vertex at nybble index i of the path
+// !! nybble index is double what the path index is !!
+// odd numbers are the second element, the bottom nybble (index /2),
+// even numbers the first element, the top nybble
+static constexpr byte pathVertex(int i)
 {
-	if (wirefly_interrupt())
-		return 1;
+	return (i & 1) ? path[i >> 1] & 0xf : path[i >> 1] >> 4;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Fade tables
+// A fade is a loop of keyframe colours, kept in flash. The compiler works the
+// keyframes out from the tables above, so none of vertex[], path[] or the
+// keyframes take any RAM, and fade_at() finds the colour anywhere along the
+// loop in constant time, so the fades are a pure function of time.
+
+// fade_table<key, N>::keys[] is key(0) .. key(N-1), in flash
+template <coord (*key)(int), typename S> struct fade_keys;
+template <coord (*key)(int), int... I> struct fade_keys<key, index_seq<I...> > {
+	static const coord keys[sizeof...(I)];
+};
+template <coord (*key)(int), int... I>
+const coord fade_keys<key, index_seq<I...> >::keys[sizeof...(I)] PROGMEM = { key(I)... };
 
-	if ((dx == 0) && (dy == 0) && (dz == 0))   // no point looping if we are staying in the same spot!
-		return 0;
+template <coord (*key)(int), int N>
+struct fade_table : fade_keys<key, typename index_count<N>::seq> {};
 
-	for (int i = 0; i < MAX_RGB_VALUE-MIN_RGB_VALUE; i++, v.x += dx, v.y += dy, v.z += dz)
-	{
-		// set the colour in the LED
-                rgbSet(v.x, v.y, v.z);
+// the colour frac/255 of the way from keyframe i to keyframe i+1
+static coord fade_at(const coord* keys, int i, byte frac)
+{
+	const byte* a = (const byte*) &keys[i];
+	const byte* b = (const byte*) &keys[i + 1];
+	coord c;
+	c.x = color_blend(pgm_read_byte(a), pgm_read_byte(b), frac);
+	c.y = color_blend(pgm_read_byte(a + 1), pgm_read_byte(b + 1), frac);
+	c.z = color_blend(pgm_read_byte(a + 2), pgm_read_byte(b + 2), frac);
+	return c;
+}
 
-		// wait for the transition delay
-		if (wirefly_delay(FADE_TRANSITION_DELAY))
-			return 1;
-	}
+// Keyframes for the fade engine
+// A pattern drawn from network time gives its colour at any moment. Every
+// PATTERN_KEY_TIME it hands the engine the colour due at the end of the next
+// period, and the engine fades there by itself, so loop() does a few sums a
+// second rather than one per level. A jump in network time is smoothed over
+// one period instead of showing as a step.
+#define PATTERN_KEY_TIME  250
 
-	// give it an extra rest at the end of the traverse
-	if (wirefly_delay(FADE_WAIT_DELAY))
-		return 1;
+static void pattern_keyframe(coord (*color)(unsigned long t))
+{
+	unsigned long t = network_millis();
+	if (!pattern_frame(t / PATTERN_KEY_TIME))
+		return;
+	unsigned long next = (t / PATTERN_KEY_TIME + 1) * PATTERN_KEY_TIME;
+	coord c = color(next);
+	rgbFade(c.x, c.y, c.z, next - t);
 }
 
-void pattern_testLED()
+// each colour for 2 seconds, in step across the network
+#define TESTLED_DELAY  2000
+
+void pattern_testLED(unsigned long now)
 {
+	static const byte testColors[][3] = {
+		{MAX_RGB_VALUE, 0, 0},  //red
+		{0, MAX_RGB_VALUE, 0},  //green
+		{0, 0, MAX_RGB_VALUE},  //blue
+		{0, 0, MAX_RGB_VALUE},  //blue
+		{0, 0, MAX_RGB_VALUE},  //blue
+	};
+
 #ifdef SERIAL_DEBUG
-	Serial.println("Begin pattern: testLED rgb test");
+	if (pattern_state.step == 0)
+		Serial.println("Begin pattern: testLED rgb test");
 #endif
-	while (true) {
-                rgbSet(MAX_RGB_VALUE, 0, 0);  //red
-                wirefly_delay(2000);
-                rgbSet(0, MAX_RGB_VALUE, 0);  //green
-				wirefly_delay(2000);
-                rgbSet(0, 0, MAX_RGB_VALUE);  //blue
-				wirefly_delay(2000);
-                rgbSet(0, 0, MAX_RGB_VALUE);  //blue
-				wirefly_delay(2000);
-                rgbSet(0, 0, MAX_RGB_VALUE);  //blue
-				wirefly_delay(2000);
-
-		if (wirefly_interrupt()) return;
+
+	if (!pattern_frame(network_millis() / TESTLED_DELAY))
+		return;
+
+	// with several fireflies, each one a colour on from the last
+	for (byte led = 0; led < RGB_LEDS; ++led) {
+		const byte* c = testColors[(pattern_state.mark + led) % (sizeof testColors / sizeof testColors[0])];
+		if (led == 0)
+			TRACE(TRACE_RGBSET, c[0], c[1], c[2]);
+		rgbFadeLed(led, c[0], c[1], c[2], 0);
 	}
 }
 
-void pattern_rgbFader()
+// Keyframe n is where edge n of the path starts, the path vertices in turn,
+// leaving out a vertex the next one repeats (the first, for the last): the
+// old pattern skipped those edges, they have no length. The last keyframe is
+// the first again. rgbSet() fits the full range to the LED.
+static constexpr byte fader_level(byte corner)
+{
+	return corner ? 255 : 0;
+}
+
+// true if the path moves on from the vertex at nybble index i
+static constexpr bool fader_moves(int i)
+{
+	return pathVertex(i) != pathVertex(i + 1 < (int) (2 * MAX_PATH_SIZE) ? i + 1 : 0);
+}
+
+// edges of non-zero length from nybble index i to the end of the path
+static constexpr int fader_edges(int i = 0)
+{
+	return i == 2 * MAX_PATH_SIZE ? 0 : fader_moves(i) + fader_edges(i + 1);
+}
+
+// nybble index of the vertex edge n starts at, looking from index i on
+static constexpr int fader_start(int n, int i = 0)
+{
+	return !fader_moves(i) ? fader_start(n, i + 1) : n == 0 ? i : fader_start(n - 1, i + 1);
+}
+
+#define FADER_EDGES  fader_edges()
+
+static constexpr coord fader_key(int n)
+{
+	return coord {
+		fader_level(vertex[pathVertex(fader_start(n % FADER_EDGES))].x),
+		fader_level(vertex[pathVertex(fader_start(n % FADER_EDGES))].y),
+		fader_level(vertex[pathVertex(fader_start(n % FADER_EDGES))].z),
+	};
+}
+
+typedef fade_table<fader_key, FADER_EDGES + 1> fader_keys;
+
+// Every edge of the path takes FADE_EDGE_TIME of network time: the fade, then
+// a rest at the vertex. Where we are is worked out from network_millis() alone.
+#define  FADE_TRANSITION_TIME  ((unsigned long) (MAX_RGB_VALUE - MIN_RGB_VALUE) * FADE_TRANSITION_DELAY)
+#define  FADE_EDGE_TIME        (FADE_TRANSITION_TIME + FADE_WAIT_DELAY)
+
+// the fader's colour at network time t
+static coord fader_color(unsigned long t)
+{
+	int edge = (t / FADE_EDGE_TIME) % FADER_EDGES;
+	unsigned long e = t % FADE_EDGE_TIME;
+	byte frac = e >= FADE_TRANSITION_TIME ? 255 : e * 255 / FADE_TRANSITION_TIME;
+	return fade_at(fader_keys::keys, edge, frac);
+}
+
+void pattern_rgbFader(unsigned long now)
 {
 #ifdef SERIAL_DEBUG
-	Serial.println("Begin pattern: rgbPulse");
+	if (pattern_state.step == 0)
+		Serial.println("Begin pattern: rgbPulse");
 #endif
-	while (true) 
-	{
-		int v1, v2 = 0;    // the new vertex and the previous one
-
-		// initialise the place we start from as the first vertex in the array
-		v.x = (vertex[v2].x ? MAX_RGB_VALUE : MIN_RGB_VALUE);
-		v.y = (vertex[v2].y ? MAX_RGB_VALUE : MIN_RGB_VALUE);
-		v.z = (vertex[v2].z ? MAX_RGB_VALUE : MIN_RGB_VALUE);
-
-		if (wirefly_interrupt())
-			return;
-
-		// Now just loop through the path, traversing from one point to the next
-		for (int i = 0; i < 2 * MAX_PATH_SIZE; i++)
-		{
-			// !! loop index is double what the path index is as it is a nybble index !!
-			v1 = v2;
-			if (i & 1)  // odd number is the second element and ...
-				v2 = path[i >> 1] & 0xf;  // ... the bottom nybble (index /2) or ...
-			else      // ... even number is the first element and ...
-				v2 = path[i >> 1] >> 4;  // ... the top nybble
-
-			if (traverse(vertex[v2].x - vertex[v1].x,
-					vertex[v2].y - vertex[v1].y,
-					vertex[v2].z - vertex[v1].z))
-				return;
-		}
-	}
+
+	pattern_keyframe(fader_color);
 }
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // PATTERN_PULSER:
-void pattern_rgbpulse() {
-	int r, g, b;
+// Six fades around the colour wheel, one colour channel moving at a time,
+// 256 levels each, one level every PULSE_COLORSPEED ms of network time.
+
+// which channel moves in each fade, and whether it fades up (1) or down (0)
+static constexpr byte pulse_fades[6][2] = {
+	{0, 1},  // fade from blue to violet
+	{2, 0},  // fade from violet to red
+	{1, 1},  // fade from red to yellow
+	{0, 0},  // fade from yellow to green
+	{2, 1},  // fade from green to teal
+	{1, 0},  // fade from teal to blue
+};
+
+// channel ch at the start of fade n: where the last fade that moved it left
+// it, or where the wheel starts, blue
+static constexpr byte pulse_level(int n, byte ch)
+{
+	return n == 0 ? (ch == 2 ? 255 : 0) :
+		pulse_fades[n - 1][0] == ch ? (pulse_fades[n - 1][1] ? 255 : 0) :
+		pulse_level(n - 1, ch);
+}
+
+static constexpr coord pulse_key(int n)
+{
+	return coord { pulse_level(n, 0), pulse_level(n, 1), pulse_level(n, 2) };
+}
+
+typedef fade_table<pulse_key, 6 + 1> pulse_keys;
+
+// the pulser's colour at network time t
+static coord pulse_color(unsigned long t)
+{
+	unsigned long level = t / PULSE_COLORSPEED;
+	return fade_at(pulse_keys::keys, (level >> 8) % 6, level);
+}
+
+void pattern_rgbpulse(unsigned long now) {
 #ifdef SERIAL_DEBUG
-	Serial.println("pattern_rgbPulse()");
+	if (pattern_state.step == 0)
+		Serial.println("pattern_rgbPulse()");
 #endif
-	while (true)
-	{
-		// fade from blue to violet
-		for (r = 0; r < 256; r++) { 
-			rgbSet(r,g,b);
-			if (wirefly_delay(PULSE_COLORSPEED)) return;
-		}
-		// fade from violet to red
-		for (b = 255; b > 0; b--) {
-			rgbSet(r,g,b);
-			if (wirefly_delay(PULSE_COLORSPEED)) return;
-		}
-		// fade from red to yellow
-		for (g = 0; g < 256; g++) {
-			rgbSet(r,g,b);
-			if (wirefly_delay(PULSE_COLORSPEED)) return;
-		}
-		// fade from yellow to green
-		for (r = 255; r > 0; r--) {
-			rgbSet(r,g,b);
-			if (wirefly_delay(PULSE_COLORSPEED)) return;
-		}
-		// fade from green to teal
-		for (b = 0; b < 256; b++) {
-			rgbSet(r,g,b);
-			if (wirefly_delay(PULSE_COLORSPEED)) return;
-		}
-		// fade from teal to blue
-		for (g = 255; g > 0; g--) {
-			rgbSet(r,g,b);
-			if (wirefly_delay(PULSE_COLORSPEED)) return;
-		}
-	}
+
+	pattern_keyframe(pulse_color);
 }
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = =
 // PATTERN_CLOCKSYNC:
-void pattern_clockSync( ) {
-#ifdef SERIAL_DEBUG
-	Serial.println("pattern_clockSync()");
-#endif
-	// rf12b-calibrated, about the time it takes to send a packet in milliseconds
-	unsigned long time_cycle = 750;
-
-	// loop variables use to keep track of how long to listen
-	unsigned long time_start = 0;
-	unsigned long time_end = 0;
-
-	// track total time on and off, millis
-	unsigned long sum_ON = 0;
-	unsigned long sum_OFF = 0;
-
-	// used to make adjustments to the time_cycle
-	int ON_longer = 0;
-	int OFF_longer = 0;
-
-	// track pings received in either on/off state
-	int ON_count = 0;
-	int OFF_count = 0;
-
-	//turn all lights off
-	pattern_off();
-
-	//  debounceInputs();
-	wirefly_delay(random(0, 2001)); //make sure everyone starts at a somewhat different time
-	//  debounceInputs();
-
-	while(true)
-	{
-		//reset counters for this loop
-		ON_count = 0;
-		sum_ON = 0;
-		OFF_count = 0;
-
-		//Phase1 LED on, send ping
-		rgbSet(123,123,123); //turn LED on
-
-		//transmit a packet, while the LED is on
-		if (rf12_canSend()) {
-			wirefly_msg_stack[0] = WIREFLY_SEND_CLOCKSYNC;
-			wirefly_msg_stack[1] = 0;
-			rf12_sendStart(0, wirefly_msg_stack, 2);
-		}
-		//welcome back from radio land
-
-		time_start = millis(); //start time is now
-		time_end = time_start + time_cycle + ON_longer; // decide how long to listen w/ LED on
-
-		while (millis() < time_end) { //listen for pings until the time is up
-			//      debounceInputs();
-			if (rf12_recvDone() && !rf12_crc) { //if we get a good packet
-#ifdef SERIAL_DEBUG
-				//        Serial.print("rf12_len "); Serial.println(rf12_len);
-				//        Serial.print("rf12_data[0] "); Serial.println(rf12_data[0]);
-#endif
-				if (rf12_data[0] == WIREFLY_SEND_CLOCKSYNC) 
-				// ...if we get a clocksync ping msg, then calculate
-				{
-					//this means somebody else is on at the same time as me, keep track
-					sum_ON += millis() - time_start;
-					ON_count++;
-				}
-			}
-		}
-
-		//Phase2 LED off
-		rgbSet(MAX_RGB_VALUE, MAX_RGB_VALUE, MAX_RGB_VALUE); //turn LED off
-
-		time_start = millis(); //reset start time to now
-		time_end = time_start + time_cycle + OFF_longer; //how long to listen w/ LED off
-
-		while (millis() < time_end) { //listen for pings until the time is up
-			//      debounceInputs();
-			if (rf12_recvDone() && rf12_crc == 0){ //if we get a good packet
+// Pulse-coupled oscillators, after Mirollo & Strogatz, with the phase carried
+// in the ping. Every lantern runs a CLOCKSYNC_PERIOD cycle with the LED on for
+// the first CLOCKSYNC_ON of it. Once per cycle, at a random point early in the
+// ON half, it broadcasts its current phase; every ping heard pulls our phase
+// half way towards the sender's, bounded by CLOCKSYNC_MAX_STEP so the LED never
+// jumps visibly. A lantern that has already heard CLOCKSYNC_QUORUM pings that
+// agree with its own phase this cycle keeps quiet, its ping would add nothing,
+// and takes back one still queued behind a busy channel.
+// Pings arrive through clockSync_onPing(), which the pattern subscribes to the
+// WIREFLY_SEND_CLOCKSYNC records with on entry.
+
+#define CLOCKSYNC_PERIOD       1500 // ms, one on/off cycle
+#define CLOCKSYNC_ON            750 // ms of each cycle with the LED on
+#define CLOCKSYNC_PING_WINDOW   250 // ms, pings go out at a random phase below this
+#define CLOCKSYNC_LATENCY         2 // ms, about the time a ping spends on the air
+#define CLOCKSYNC_TOLERANCE      20 // ms, a ping this close agrees with us
+#define CLOCKSYNC_QUORUM          2 // agreeing pings that make our own redundant
+#define CLOCKSYNC_MAX_STEP      200 // ms, largest correction from a single ping
+
+static struct {
+	unsigned long epoch;    // millis() at which the current cycle began
+	word ping_at;           // phase at which to ping this cycle
+	byte pinged;            // ping sent, or suppressed, this cycle
+	byte agreed;            // pings heard this cycle that agree with our phase
+} clockSync;
+
+// our phase in the current cycle, negative if a correction moved us back
+// past the start of the cycle
+static long clockSync_phase(unsigned long now)
+{
+	return (long) (now - clockSync.epoch);
+}
+
+static void clockSync_cycle()
+{
+	clockSync.ping_at = wirefly_random(CLOCKSYNC_PING_WINDOW);
+	clockSync.pinged = 0;
+	clockSync.agreed = 0;
+}
+
+// a ping: the sender's phase, hi and lo byte
+static void clockSync_onPing(byte sender, const byte* value, byte len)
+{
+	if (pattern_active != PATTERN_CLOCKSYNC || pattern_state.step == 0 || len < 2)
+		return; // we've moved on to another pattern since subscribing
+
+	unsigned long now = hal_millis();
+	word phase = (value[0] << 8) | value[1];
+
+	// phase response: how far the sender is ahead of us, wrapped to +-half a cycle
+	long delta = (long) (phase + CLOCKSYNC_LATENCY) - clockSync_phase(now);
+	delta %= CLOCKSYNC_PERIOD;
+	if (delta >= CLOCKSYNC_PERIOD / 2)
+		delta -= CLOCKSYNC_PERIOD;
+	else if (delta < -CLOCKSYNC_PERIOD / 2)
+		delta += CLOCKSYNC_PERIOD;
+
+	if (delta <= CLOCKSYNC_TOLERANCE && delta >= -CLOCKSYNC_TOLERANCE && clockSync.agreed < 255)
+		clockSync.agreed++;
+	// a quorum makes our ping redundant, even one already waiting for the channel
+	if (clockSync.agreed >= CLOCKSYNC_QUORUM && wirefly_msgCancel(WIREFLY_SEND_CLOCKSYNC))
+		clockSync.pinged = 1;
+
+	delta /= 2;
+	if (delta > CLOCKSYNC_MAX_STEP)
+		delta = CLOCKSYNC_MAX_STEP;
+	else if (delta < -CLOCKSYNC_MAX_STEP)
+		delta = -CLOCKSYNC_MAX_STEP;
+	clockSync.epoch -= delta; // an earlier epoch moves our phase ahead
+}
+
+void pattern_clockSync(unsigned long now) {
+	if (pattern_state.step == 0) {
 #ifdef SERIAL_DEBUG
-				//        Serial.print("rf12_len "); Serial.println(rf12_len);
-				//        Serial.print("rf12_data[0] "); Serial.println(rf12_data[0]);
+		Serial.println("pattern_clockSync()");
 #endif
-				if (rf12_data[0] == WIREFLY_SEND_CLOCKSYNC)
-				// ...if we get a clocksync ping msg, then calculate
-				{
-					//this means somebody else is on when I am off, keep track
-					sum_OFF += time_end - millis(); 
-					OFF_count++;
-				}
-			}
-		}
-
-		//Phase3 make some decisions
-		if (ON_count > OFF_count) // I am more in-sync than out-of-sync
-		{
-			ON_longer = 0;
-			OFF_longer = (sum_ON/ON_count) >> 1;
-		}
-		else if (ON_count < OFF_count) //I am more out-of-sync than in-sync
-		{
-			OFF_longer = 0;
-			ON_longer = (sum_ON/ON_count) >> 1;
-		}
-		else if (ON_count == 0 && OFF_count == 0) //initial state...
-		{
-			ON_longer = 0;
-			OFF_longer = 0;
-		}
-		else if (ON_count == OFF_count) //I am just plain out of phase
-		{
-			if (sum_ON < sum_OFF) // use a more precise method
-			{
-				ON_longer = 0;
-				OFF_longer = (sum_ON/ON_count) >> 1;
-			}
-			else
-			{
-				OFF_longer = 0;
-				ON_longer = (sum_OFF/OFF_count) >> 1;
-			}
-		}
-
-		if (wirefly_interrupt() && pattern_get() != PATTERN_CLOCKSYNC)
-			return;
+		//make sure everyone starts at a somewhat different phase
+		clockSync.epoch = now - wirefly_random(CLOCKSYNC_PERIOD);
+		clockSync_cycle();
+		wirefly_subscribe(WIREFLY_SEND_CLOCKSYNC, clockSync_onPing);
+		pattern_state.step = 1;
+		pattern_state.i = -1; // LED state unknown, set it below
+	}
+
+	long phase = clockSync_phase(now);
+	if (phase >= CLOCKSYNC_PERIOD) { // the next cycle has begun
+		clockSync.epoch += CLOCKSYNC_PERIOD * (phase / CLOCKSYNC_PERIOD);
+		phase = clockSync_phase(now);
+		clockSync_cycle();
+	}
+
+	int led = phase >= 0 && phase < CLOCKSYNC_ON;
+	if (led != pattern_state.i) {
+		if (led)
+			rgbSet(123,123,123); //turn LED on
+		else
+			rgbSet(MAX_RGB_VALUE, MAX_RGB_VALUE, MAX_RGB_VALUE); //turn LED off
+		pattern_state.i = led;
+	}
+
+	if (clockSync.pinged || phase < clockSync.ping_at)
+		return;
+
+	if (clockSync.agreed >= CLOCKSYNC_QUORUM || phase >= CLOCKSYNC_ON) {
+		clockSync.pinged = 1; // in step with our neighbours already, or too late
+	}
+	else {
+		//transmit our phase, while the LED is on; wirefly_send() puts it
+		//on the air when the channel is free, and fills in the phase then
+		wirefly_msgQueue(WIREFLY_SEND_CLOCKSYNC, WIREFLY_PRIO_SYNC, 2);
+		clockSync.pinged = 1;
 	}
 }
 
+// a ping's value: our phase as it goes on the air, however long it queued
+void pattern_clockSyncStamp(byte* value) {
+	long phase = clockSync_phase(hal_millis()) % CLOCKSYNC_PERIOD;
+	if (phase < 0)
+		phase += CLOCKSYNC_PERIOD;
+	value[0] = phase >> 8;
+	value[1] = phase;
+}
@@ -0,0 +1,89 @@
+#include "hal.h"
+#include "firefly.h"
+
+#ifdef LOOP_STATS
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Loop timing, see stats.h
+
+typedef struct
+{
+	unsigned long count;
+	unsigned long total;  // us, saturates
+	unsigned long worst;  // us
+	word buckets[STATS_BUCKETS];  // saturate
+} stats_phase;
+
+static stats_phase stats[STATS_COUNT];
+
+static const char stats_names[][8] PROGMEM = {
+	"input", "display", "send", "frame", "apply",
+};
+
+// the bucket of a time: the number of bits it takes
+static byte stats_bucket(unsigned long us)
+{
+	byte b = 0;
+	while (us && b < STATS_BUCKETS - 1) {
+		us >>= 1;
+		++b;
+	}
+	return b;
+}
+
+// count one time of phase which
+void stats_add(byte which, unsigned long us)
+{
+	stats_phase* s = &stats[which];
+	++s->count;
+	s->total = s->total + us < s->total ? 0xFFFFFFFF : s->total + us;
+	if (us > s->worst)
+		s->worst = us;
+	word* b = &s->buckets[stats_bucket(us)];
+	if (*b < 0xFFFF)
+		++*b;
+}
+
+// print every phase: name, count, mean, worst, then the bucket counts,
+// one column per power of two; and start over if clear
+void stats_dump(boolean clear)
+{
+	Serial.print("phase count mean_us worst_us | 0");
+	for (byte b = 1; b < STATS_BUCKETS; ++b) {
+		Serial.print(" <");
+		Serial.print(1UL << b);
+	}
+	Serial.println();
+	for (byte i = 0; i < STATS_COUNT; ++i) {
+		stats_phase* s = &stats[i];
+		char name[sizeof stats_names[0]];
+		strcpy_P(name, stats_names[i]);
+		Serial.print(name);
+		Serial.print(' ');
+		Serial.print(s->count);
+		Serial.print(' ');
+		Serial.print(s->count ? s->total / s->count : 0);
+		Serial.print(' ');
+		Serial.print(s->worst);
+		Serial.print(" |");
+		for (byte b = 0; b < STATS_BUCKETS; ++b) {
+			Serial.print(' ');
+			Serial.print((unsigned int) s->buckets[b]);
+		}
+		Serial.println();
+	}
+	const wirefly_power* p = wirefly_powerCounters();
+	Serial.print("power wakeups ");
+	Serial.print(p->wakeups);
+	Serial.print(" awake_us ");
+	Serial.print(p->awakeUs);
+	Serial.print(" asleep_ms ");
+	Serial.print(p->sleepMs);
+	Serial.print(" listen_ms ");
+	Serial.println(p->listenMs);
+	if (clear)
+		memset(stats, 0, sizeof stats);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __WIREFLY_STATS_H
+#define __WIREFLY_STATS_H
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Loop timing
+// With LOOP_STATS on, loop() times each of its phases with hal_micros()
+// and keeps, per phase, the count, total and worst time and a histogram in
+// power-of-two buckets: bucket 0 is 0 us, bucket b is 2^(b-1) up to 2^b us,
+// the last one everything from 2^(STATS_BUCKETS-2) us up. STATS_APPLY is the
+// time from a pattern frame coming off the air to the new pattern's first
+// frame on the LEDs. The 'h' serial command prints them all (see RF12.h),
+// and the power counters as they stand.
+// Costs four hal_micros() calls per loop() and about 220 bytes of RAM.
+
+#define STATS_BUCKETS  16
+
+enum {
+	STATS_INPUT,    // PHASE1: wirefly_interrupt()
+	STATS_DISPLAY,  // PHASE2: pattern_run()
+	STATS_SEND,     // PHASE3: wirefly_send()
+	STATS_FRAME,    // all of loop()
+	STATS_APPLY,    // received pattern to LEDs
+	STATS_COUNT
+};
+
+#ifdef LOOP_STATS
+void stats_add(byte which, unsigned long us);
+void stats_dump(boolean clear);
+#else
+#define stats_add(which, us)
+#define stats_dump(clear)
+#endif
+
+#endif
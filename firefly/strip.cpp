@@ -0,0 +1,179 @@
+#include "hal.h"
+#include "firefly.h"
+
+#ifdef LED_ADDR
+
+#if defined(RGB_NEOPIX) && defined(SERIAL_DEBUG)
+#error "RGB_NEOPIX sends through the serial port's USART, turn SERIAL_DEBUG off"
+#endif
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Addressable strip, see strip.h
+
+#define STRIP_BYTES  (STRIP_PIXELS * STRIP_PIXEL_BYTES)
+#define STRIP_RUN    (STRIP_PIXELS / STRIP_LEDS)
+
+static volatile byte strip_back[STRIP_BYTES];  // drawn into
+static byte strip_front[STRIP_BYTES];          // last pushed
+static volatile boolean strip_dirty;
+static unsigned long strip_shownAt;
+static strip_counters strip_count;
+
+#if defined(RGB_NEOPIX)
+
+// WS2812 bits as the USART sends them, 3 to a bit, 110 for a 1 and 100 for
+// a 0; ws_table[n] is nybble n's 12, top bit first
+static constexpr word ws_bits(byte n, byte i = 4)
+{
+	return i == 0 ? 0 : ws_bits(n, i - 1) | ((n >> (i - 1) & 1 ? 6 : 4) << (3 * (i - 1)));
+}
+
+static const word ws_table[16] PROGMEM = {
+	ws_bits(0), ws_bits(1), ws_bits(2), ws_bits(3), ws_bits(4), ws_bits(5), ws_bits(6), ws_bits(7),
+	ws_bits(8), ws_bits(9), ws_bits(10), ws_bits(11), ws_bits(12), ws_bits(13), ws_bits(14), ws_bits(15),
+};
+
+// where channel k (red, green, blue) of a pixel is
+static const byte strip_offset[3] = { 1, 0, 2 };
+
+static void strip_push()
+{
+	const byte* p = strip_front;
+	for (byte i = 0; i < STRIP_PIXELS; ++i) {
+		byte out[3 * STRIP_PIXEL_BYTES];
+		for (byte k = 0; k < STRIP_PIXEL_BYTES; ++k, ++p) {
+			word hi = pgm_read_word(&ws_table[*p >> 4]);
+			word lo = pgm_read_word(&ws_table[*p & 0xF]);
+			out[3 * k] = hi >> 4;
+			out[3 * k + 1] = (hi << 4) | (lo >> 8);
+			out[3 * k + 2] = lo;
+		}
+		cli(); // a gap inside a pixel would end the frame
+		hal_usartSpiWrite(out, sizeof out);
+		sei();
+	}
+}
+
+#else
+
+// where the 5-bit field of channel k (red, green, blue) is, in the low and
+// high byte of a pixel
+static const byte strip_shift[3] = { 0, 10, 5 };
+
+static void strip_push()
+{
+	hal_stripClock(0);
+	byte data = 1 << STRIP_DATA_BIT, clock = 1 << STRIP_CLOCK_BIT;
+	// 32 zero bits start a frame
+	hal_portWrite(STRIP_DATA_PORT, data, 0);
+	for (byte i = 0; i < 32; ++i) {
+		hal_portWrite(STRIP_CLOCK_PORT, clock, 0);
+		hal_portWrite(STRIP_CLOCK_PORT, clock, clock);
+	}
+	for (word i = 0; i < STRIP_BYTES; ++i) {
+		byte b = strip_front[i];
+		for (byte m = 0x80; m; m >>= 1) {
+			hal_portWrite(STRIP_CLOCK_PORT, clock, 0);
+			hal_portWrite(STRIP_DATA_PORT, data, b & m ? data : 0);
+			hal_portWrite(STRIP_CLOCK_PORT, clock, clock);
+		}
+	}
+	// the timer's clocks latch it, one for every pixel
+	hal_portWrite(STRIP_DATA_PORT, data, 0);
+	hal_stripClock(1);
+}
+
+#endif
+
+// all pixels dark, and the strip's clock running
+void strip_begin()
+{
+#if !defined(RGB_NEOPIX)
+	for (byte i = 0; i < STRIP_PIXELS; ++i)
+		strip_back[i * STRIP_PIXEL_BYTES] = 0x80; // the start bit
+#endif
+	strip_dirty = true;
+#if defined(RGB_NEOPIX)
+	hal_usartSpiBegin();
+#else
+	hal_portMode(STRIP_DATA_PORT, 1 << STRIP_DATA_BIT);
+	hal_portMode(STRIP_CLOCK_PORT, 1 << STRIP_CLOCK_BIT);
+	hal_stripClock(1);
+#endif
+}
+
+// set channel k of pixel i to value; true if it changed
+static boolean strip_put(byte i, byte k, byte value)
+{
+	volatile byte* p = &strip_back[i * STRIP_PIXEL_BYTES];
+#if defined(RGB_NEOPIX)
+	if (p[strip_offset[k]] == value)
+		return false;
+	p[strip_offset[k]] = value;
+#else
+	word w = (word) p[0] << 8 | p[1];
+	word f = (word) (value >> 3) << strip_shift[k];
+	word mask = (word) 0x1F << strip_shift[k];
+	if ((w & mask) == f)
+		return false;
+	w = 0x8000 | (w & ~mask) | f;
+	p[0] = w >> 8;
+	p[1] = w;
+#endif
+	return true;
+}
+
+// channel ch of the fade engine, ch / 3 the firefly, ch % 3 red, green,
+// blue, to brightness value; from the tick
+void strip_write(byte ch, byte value)
+{
+	byte first = ch / 3 * STRIP_RUN;
+	boolean changed = false;
+	for (byte i = first; i < first + STRIP_RUN; ++i)
+		changed |= strip_put(i, ch % 3, value);
+	if (changed)
+		strip_dirty = true;
+}
+
+// pixel to r, g, b, brightness, for patterns that draw the strip themselves
+void strip_set(byte pixel, byte r, byte g, byte b)
+{
+	if (pixel >= STRIP_PIXELS)
+		return;
+	cli();
+	boolean changed = strip_put(pixel, 0, r);
+	changed |= strip_put(pixel, 1, g);
+	changed |= strip_put(pixel, 2, b);
+	if (changed)
+		strip_dirty = true;
+	sei();
+}
+
+// push the frame if anything changed, at most every STRIP_FRAME_MS
+void strip_show()
+{
+	unsigned long now = hal_millis();
+	if (!strip_dirty || now - strip_shownAt < STRIP_FRAME_MS)
+		return;
+	strip_shownAt = now;
+	cli();
+	for (word i = 0; i < STRIP_BYTES; ++i)
+		strip_front[i] = strip_back[i];
+	strip_dirty = false;
+	sei();
+
+	unsigned long t = hal_micros();
+	strip_push();
+	strip_count.us += hal_micros() - t;
+	strip_count.bytes += STRIP_BYTES;
+	++strip_count.frames;
+}
+
+// frames and bytes pushed since power up, and the time it took
+const strip_counters* strip_stats()
+{
+	return &strip_count;
+}
+
+#endif
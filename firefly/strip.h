@@ -0,0 +1,58 @@
+#ifndef __WIREFLY_STRIP_H
+#define __WIREFLY_STRIP_H
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Addressable strip
+// With LED_ADDR on, the fade engine drives a strip of STRIP_PIXELS instead of
+// the PWM pins: STRIP_LEDS fireflies, each a run of STRIP_PIXELS / STRIP_LEDS
+// pixels. RGB_STRIP picks the LPD6803, RGB_NEOPIX the WS2812.
+//
+// The pixels are kept twice, packed the way the chip takes them: 16 bits
+// each for the LPD6803 (a start bit and 5-5-5, green, blue, red from the
+// top), 3 bytes G, R, B for the WS2812. Writes go to the back buffer, from
+// the engine's tick or from a pattern; strip_show(), once per loop(), copies
+// it to the front buffer if anything changed and pushes the whole frame out
+// in one go, at most every STRIP_FRAME_MS.
+//
+// The LPD6803 runs its PWM off the data clock, so the clock must never
+// stop. Between frames timer 2 toggles the clock pin (IRQ, OC2B) in hardware;
+// strip_show() takes the pin back and clocks the frame out on it and the data
+// pin, about 20 us a pixel, then hands it back to the timer. The old clocker
+// interrupted for every clock edge.
+// The WS2812 frames go out through USART0 as a master SPI, TXD to the strip,
+// 3 bits for every data bit, a pixel at a time with interrupts off for 27 us.
+// That takes the serial port, so RGB_NEOPIX needs SERIAL_DEBUG off. The
+// hardware SPI is the radio's, and a strip has no select line to ignore the
+// radio's traffic with, so it isn't used.
+
+#define STRIP_PIXELS    30
+#define STRIP_LEDS      1    // fireflies along the strip
+#define STRIP_FRAME_MS  10   // shortest time between frames
+
+// LPD6803 pins, ports as for hal_portWrite(); the clock has to be IRQ (PD3),
+// timer 2's OC2B
+#define STRIP_DATA_PORT   2   // D
+#define STRIP_DATA_BIT    4   // DIO of port 1
+#define STRIP_CLOCK_PORT  2
+#define STRIP_CLOCK_BIT   3
+
+#if defined(RGB_NEOPIX)
+#define STRIP_PIXEL_BYTES  3
+#else
+#define STRIP_PIXEL_BYTES  2
+#endif
+
+typedef struct {
+	unsigned long frames;  // pushed to the strip
+	unsigned long bytes;   // of pixel data pushed
+	unsigned long us;      // spent pushing, by hal_micros()
+} strip_counters;
+
+void strip_begin();
+void strip_write(byte ch, byte value);
+void strip_set(byte pixel, byte r, byte g, byte b);
+void strip_show();
+const strip_counters* strip_stats();
+
+#endif
@@ -0,0 +1,72 @@
+#include "hal.h"
+#include "firefly.h"
+
+#ifdef SERIAL_DEBUG
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Binary trace ring, see trace.h
+
+static trace_record trace_ring[TRACE_RECORDS];
+static byte trace_head, trace_count;
+static word trace_missed; // lost since the last TRACE_LOST record
+static word trace_total;  // lost since power up
+static byte trace_lostEvent; // the first of them
+
+static void trace_put(byte event, byte a, word b, word c)
+{
+	trace_record* r = &trace_ring[(trace_head + trace_count) % TRACE_RECORDS];
+	r->event = event;
+	r->a = a;
+	r->time = hal_millis();
+	r->b = b;
+	r->c = c;
+	++trace_count;
+}
+
+// keep a record, or count it lost if the ring is full; the first record
+// after a loss is a TRACE_LOST, so that needs room too
+void trace(byte event, byte a, word b, word c)
+{
+	if (trace_count + (trace_missed ? 2 : 1) > TRACE_RECORDS) {
+		if (!trace_missed)
+			trace_lostEvent = event;
+		++trace_missed;
+		if (trace_total < 0xFFFF)
+			++trace_total;
+		return;
+	}
+	if (trace_missed) {
+		trace_put(TRACE_LOST, trace_lostEvent, trace_missed, trace_total);
+		trace_missed = 0;
+	}
+	trace_put(event, a, b, c);
+}
+
+// records lost since power up
+word trace_lost()
+{
+	return trace_total;
+}
+
+// send the records the serial transmit buffer has room for, without
+// waiting; whole records only, so other output can't land inside one
+void trace_drain()
+{
+	while (trace_count && Serial.availableForWrite() >= (int) sizeof(trace_record) + 2) {
+		const byte* r = (const byte*) &trace_ring[trace_head];
+		byte frame[sizeof(trace_record) + 2];
+		frame[0] = TRACE_SYNC;
+		byte sum = 0;
+		for (byte i = 0; i < sizeof(trace_record); ++i) {
+			frame[i + 1] = r[i];
+			sum += r[i];
+		}
+		frame[sizeof frame - 1] = sum;
+		Serial.write(frame, sizeof frame);
+		trace_head = (trace_head + 1) % TRACE_RECORDS;
+		--trace_count;
+	}
+}
+
+#endif
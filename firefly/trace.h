@@ -0,0 +1,56 @@
+#ifndef __WIREFLY_TRACE_H
+#define __WIREFLY_TRACE_H
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// = = = = = = = = = = = = = = = = = = = = = = = = = = =
+// Binary trace
+// With SERIAL_DEBUG on, TRACE(event, a, b, c) stores a fixed-size record,
+// the event, the low 16 bits of millis() and three arguments, in a RAM ring
+// in a few cycles, instead of formatting text at 57600 baud on the spot.
+// trace_drain(), once per loop(), hands as many records to the serial port
+// as its interrupt-driven transmit buffer has room for, so it never blocks.
+// Records that don't fit in the ring are counted, and a TRACE_LOST record
+// says how many went missing once there is room again.
+//
+// On the wire a record is TRACE_SYNC, the 8 record bytes and their sum.
+// TRACE_SYNC never appears in text, so records and ordinary Serial.print()
+// output can share the port; host/wirefly_trace turns the stream back into
+// a readable log, with the formats below.
+
+#define TRACE_SYNC     0xFE
+#define TRACE_RECORDS  32      // ring size, 8 bytes each
+
+// X(id, name, format); the format takes the three arguments a, b, c
+#define TRACE_EVENTS(X) \
+	X(TRACE_LOST,    "lost",    "from event %u on: %u records, %u since power up") \
+	X(TRACE_RGBSET,  "rgbset",  "%u %u %u") \
+	X(TRACE_PATTERN, "pattern", "%u epoch %u from %u") \
+	X(TRACE_TX,      "tx",      "%u bytes, types 0x%x") \
+	X(TRACE_RX,      "rx",      "from %u, %u bytes") \
+	X(TRACE_DROP,    "drop",    "from %u, ring full (%u so far)") \
+	X(TRACE_BADCRC,  "badcrc",  "%u bytes") \
+	X(TRACE_ACK,     "ack",     "header 0x%x")
+
+#define TRACE_ENUM(id, name, format) id,
+enum { TRACE_NONE, TRACE_EVENTS(TRACE_ENUM) TRACE_EVENT_COUNT };
+#undef TRACE_ENUM
+
+typedef struct
+{
+	byte event;
+	byte a;
+	word time;  // millis(), low 16 bits
+	word b, c;
+} trace_record;
+
+#ifdef SERIAL_DEBUG
+void trace(byte event, byte a, word b, word c);
+void trace_drain();
+word trace_lost();
+#define TRACE(event, a, b, c)  trace(event, a, b, c)
+#else
+#define TRACE(event, a, b, c)
+#define trace_drain()
+#endif
+
+#endif
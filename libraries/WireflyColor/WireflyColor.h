@@ -0,0 +1,81 @@
+// Fixed-point colour math for the wirefly LED backends
+//
+// Everything here is integer arithmetic on 8-bit channels, exact or rounded
+// to the nearest step, so no float code gets linked in on an ATmega.
+// Channels are 0..255 unless the name says otherwise; a "color15" is the
+// packed 5-5-5 colour of the LPD6803 strips, three 5-bit fields, the first
+// argument in the top field.
+//
+// Shared by firefly/pattern.cpp and luminaria/radio_led_client; the host
+// accuracy test and benchmark are in firefly/host/wirefly_color.cpp.
+
+#ifndef WIREFLY_COLOR_H
+#define WIREFLY_COLOR_H
+
+#include <stdint.h>
+
+// x / 255, rounded to nearest, for x up to 255 * 255, without a division
+static inline uint8_t color_div255(uint16_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+// perceived brightness of r, g, b: Rec. 601 weights in 8.8 fixed point
+// (77 + 150 + 29 = 256, so white stays 255)
+static inline uint8_t color_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+	return ((uint16_t) 77 * r + (uint16_t) 150 * g + (uint16_t) 29 * b + 128) >> 8;
+}
+
+// v scaled by s / 255, rounded; 255 leaves v as it is
+static inline uint8_t color_scale(uint8_t v, uint8_t s)
+{
+	return color_div255((uint16_t) v * s);
+}
+
+// frac / 255 of the way from a to b, exact at both ends
+static inline uint8_t color_blend(uint8_t a, uint8_t b, uint8_t frac)
+{
+	if (b >= a)
+		return a + color_div255((uint16_t) (b - a) * frac);
+	return a - color_div255((uint16_t) (a - b) * frac);
+}
+
+// v brightened (s > 128) or dimmed (s < 128), s = 128 leaving it as it is;
+// saturates at 255
+static inline uint8_t color_brightness(uint8_t v, uint8_t s)
+{
+	uint16_t x = ((uint16_t) v * s + 64) >> 7;
+	return x > 255 ? 255 : x;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Packed 5-5-5 colours
+
+// pack three 5-bit channels, hi in bits 10..14, mid 5..9, lo 0..4
+static inline uint16_t color15(uint8_t hi, uint8_t mid, uint8_t lo)
+{
+	return ((uint16_t) (hi & 0x1F) << 10) | ((uint16_t) (mid & 0x1F) << 5) | (lo & 0x1F);
+}
+
+static inline uint8_t color15_hi(uint16_t c)  { return (c >> 10) & 0x1F; }
+static inline uint8_t color15_mid(uint16_t c) { return (c >> 5) & 0x1F; }
+static inline uint8_t color15_lo(uint16_t c)  { return c & 0x1F; }
+
+// every field of c scaled by s / 255
+static inline uint16_t color15_scale(uint16_t c, uint8_t s)
+{
+	return color15(color_scale(color15_hi(c), s), color_scale(color15_mid(c), s),
+		color_scale(color15_lo(c), s));
+}
+
+// frac / 255 of the way from colour a to colour b, field by field
+static inline uint16_t color15_blend(uint16_t a, uint16_t b, uint8_t frac)
+{
+	return color15(color_blend(color15_hi(a), color15_hi(b), frac),
+		color_blend(color15_mid(a), color15_mid(b), frac),
+		color_blend(color15_lo(a), color15_lo(b), frac));
+}
+
+#endif
@@ -0,0 +1,119 @@
+// Small, fast random numbers for the wirefly patterns
+//
+// Arduino's random() is a Park-Miller generator, two 32-bit divisions a
+// draw, and a 32-bit modulo on top to get the range; on an ATmega that is
+// a couple of thousand cycles. This is Marsaglia's xorshift32 (shifts 13,
+// 17, 5, period 2^32 - 1): three shifts and xors of the state a draw.
+// Ranges are scaled with a 16 x 16 bit multiply, taking the high half, and
+// the few draws that would make some values more likely than others are
+// drawn again (Lemire's method), so rand_below() is exactly uniform without
+// a division in the common case. rand_bits() hands out a draw's 32 bits a
+// few at a time, for coin flips and power of two ranges.
+//
+// rand_seed() mixes the node id into the seed, so nodes that boot together
+// and read the same ADC noise still go their own ways, and rand_noise() mixes
+// every reading in, so nodes with the same id but a different steady reading
+// on the pin do too. Each user keeps its
+// own rand_state. Shared by firefly and luminaria/radio_led_client; the
+// host test is firefly/host/wirefly_random.cpp.
+
+#ifndef WIREFLY_RANDOM_H
+#define WIREFLY_RANDOM_H
+
+#include <stdint.h>
+
+typedef struct {
+	uint32_t x;      // xorshift state, never 0
+	uint32_t bits;   // what is left of the last draw for rand_bits()
+	uint8_t nbits;
+} rand_state;
+
+static inline uint32_t rand_next(rand_state* s)
+{
+	uint32_t x = s->x;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	s->x = x;
+	return x;
+}
+
+// the high half of a draw; xorshift's low bits are its weakest
+static inline uint16_t rand16(rand_state* s)
+{
+	return rand_next(s) >> 16;
+}
+
+// draw r scaled to 0 .. n - 1 in *value; 0 if r is one of the 65536 % n
+// draws that would bias it, and another has to be drawn
+static inline uint8_t rand_scale(uint16_t r, uint16_t n, uint16_t* value)
+{
+	uint32_t m = (uint32_t) r * n;
+	*value = m >> 16;
+	if ((uint16_t) m >= n)
+		return 1;
+	return (uint16_t) m >= (uint16_t) (65536UL - n) % n; // a division, 1 in 65536 / n times
+}
+
+// 0 to n - 1, uniform; 0 for n = 0
+static inline uint16_t rand_below(rand_state* s, uint16_t n)
+{
+	uint16_t value;
+	while (!rand_scale(rand16(s), n, &value))
+		;
+	return value;
+}
+
+// lo to hi - 1, as random(lo, hi); lo if the range is empty
+static inline uint16_t rand_range(rand_state* s, uint16_t lo, uint16_t hi)
+{
+	return hi <= lo ? lo : lo + rand_below(s, hi - lo);
+}
+
+// n random bits, n up to 8, a new draw every 32 bits
+static inline uint8_t rand_bits(rand_state* s, uint8_t n)
+{
+	if (s->nbits < n) {
+		s->bits = rand_next(s);
+		s->nbits = 32;
+	}
+	uint8_t v = s->bits & ((1 << n) - 1);
+	s->bits >>= n;
+	s->nbits -= n;
+	return v;
+}
+
+static inline uint8_t rand_bit(rand_state* s)
+{
+	return rand_bits(s, 1);
+}
+
+// 16 readings of an analog pin mixed together, to seed from; a floating
+// pin's readings differ in their low bits. Each reading goes through a
+// multiply and an xor-shift rather than a plain fold, which a steady reading
+// cancels out: the 1024 steady readings give 1024 different values.
+static inline uint32_t rand_noise(int (*read)(uint8_t pin), uint8_t pin)
+{
+	uint32_t noise = 0;
+	for (uint8_t i = 0; i < 16; ++i) {
+		noise = (noise ^ (uint16_t) read(pin)) * 0x85EBCA6BUL;
+		noise ^= noise >> 15;
+	}
+	return noise;
+}
+
+// seed from the node id and noise, mixed (a murmur3 finalizer) so that
+// seeds one bit apart start far apart
+static inline void rand_seed(rand_state* s, uint8_t node, uint32_t noise)
+{
+	uint32_t x = noise + node * 0x9E3779B9UL;
+	x ^= x >> 16;
+	x *= 0x85EBCA6BUL;
+	x ^= x >> 13;
+	x *= 0xC2B2AE35UL;
+	x ^= x >> 16;
+	s->x = x ? x : 1;
+	s->nbits = 0;
+}
+
+#endif
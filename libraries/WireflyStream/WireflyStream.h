@@ -0,0 +1,308 @@
+// Framebuffer streaming over the RF12 for the luminaria ad hoc pattern
+//
+// A frame is the colour of every pixel of a strip, packed 5-5-5 as for the
+// LPD6803s (see WireflyColor.h). It goes out as one or more parts, one part
+// to a packet. Each part says which frame it belongs to and which pixel it
+// starts at, so a part can be decoded on its own, and a lost one only costs
+// its own pixels:
+//
+//   seq    frame sequence number, one up for each frame, wrapping at 256
+//   first  the pixel the part's ops start at
+//   flags  STREAM_LAST on the frame's last part
+//   ops    up to the end of the packet, a tag byte and its data
+//
+//   00nnnnnn          skip n + 1 pixels, they are as they were
+//   01nnnnnn c        n + 1 pixels of colour c
+//   10nnnnnn c...     n + 1 pixels, a colour each
+//   11nnnnnn i...     n + 1 pixels (n < 48), a 4-bit palette index each, two
+//                     to a byte, the first in the high nybble
+//   1111nnnn c...     the part's palette: n + 1 colours, indexes 0 to n
+//
+// Colours are 2 bytes, low byte first. A palette only holds for the rest of
+// its part. Skips make a frame a delta against the one before it, so a
+// receiver that lost a part stays wrong until those pixels change again;
+// the sender sends a key frame (no previous frame, nothing skipped) every
+// so often.
+//
+// A strip has up to 255 pixels; radio_led_client's is PIX_COUNT long.
+// stream_part() and stream_decode() are the receiving end, used by
+// luminaria/radio_led_client for PATTERN_ADHOC. stream_encode() is for
+// senders. firefly/host/wirefly_stream.cpp checks that the two round trip
+// and works out the bytes and packets a frame takes.
+
+#ifndef WIREFLY_STREAM_H
+#define WIREFLY_STREAM_H
+
+#include <stdint.h>
+
+#define STREAM_HEADER    3    // seq, first, flags
+#define STREAM_PART_MAX  65   // RF12_MAXDATA, less the pattern byte
+#define STREAM_LAST      0x01 // flags: the frame's last part
+
+#define STREAM_SKIP      0x00
+#define STREAM_RUN       0x40
+#define STREAM_LITERAL   0x80
+#define STREAM_INDEXED   0xC0
+#define STREAM_PALETTE   0xF0
+
+#define STREAM_OP_MAX       64   // pixels in a skip, run or literal
+#define STREAM_INDEXED_MAX  48
+#define STREAM_PALETTE_MAX  16
+
+// what to do with a part, from stream_part()
+#define STREAM_DROP   0x01 // stale or a repeat, ignore it
+#define STREAM_FLUSH  0x02 // it starts a new frame, show the last one first
+#define STREAM_SHOW   0x04 // it ends its frame, show it once decoded
+
+// a seq this far behind the current frame is a stale part; further than
+// that and the sender has started over
+#define STREAM_STALE  8
+
+typedef struct {
+	uint8_t seq;    // the frame being received
+	uint8_t state;  // STREAM_IDLE, STREAM_OPEN, STREAM_SHOWN
+} stream_state;
+
+#define STREAM_IDLE   0 // no frame yet, take any seq
+#define STREAM_OPEN   1 // parts of seq decoded, not shown
+#define STREAM_SHOWN  2 // seq shown, its parts are repeats
+
+static inline uint16_t stream_color(const uint8_t* p)
+{
+	return p[0] | (uint16_t) p[1] << 8;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Receiving
+
+// start over, taking the next part of any frame
+static inline void stream_reset(stream_state* s)
+{
+	s->state = STREAM_IDLE;
+}
+
+// what to do with part, len bytes: STREAM_DROP, or STREAM_FLUSH and/or
+// STREAM_SHOW around stream_decode()
+static inline uint8_t stream_part(stream_state* s, const uint8_t* part, uint8_t len)
+{
+	if (len < STREAM_HEADER)
+		return STREAM_DROP;
+	uint8_t what = 0;
+	int8_t ahead = part[0] - s->seq;
+	if (s->state != STREAM_IDLE) {
+		if (ahead < 0 && ahead >= -STREAM_STALE)
+			return STREAM_DROP;
+		if (ahead == 0 && s->state == STREAM_SHOWN)
+			return STREAM_DROP;
+		if (ahead != 0 && s->state == STREAM_OPEN)
+			what |= STREAM_FLUSH; // the last frame's last part was lost
+	}
+	s->seq = part[0];
+	s->state = STREAM_OPEN;
+	if (part[2] & STREAM_LAST) {
+		s->state = STREAM_SHOWN;
+		what |= STREAM_SHOW;
+	}
+	return what;
+}
+
+// apply part's ops, set(pixel, colour) for each pixel below count that it
+// gives a colour; 0 if the part was cut short or malformed, the ops before
+// that applied
+static inline uint8_t stream_decode(const uint8_t* part, uint8_t len,
+	void (*set)(uint8_t pixel, uint16_t color), uint8_t count)
+{
+	uint16_t palette[STREAM_PALETTE_MAX];
+	uint8_t npalette = 0;
+	uint16_t p = part[1];
+	uint8_t i = STREAM_HEADER;
+	while (i < len) {
+		uint8_t op = part[i++];
+		uint8_t n = (op & 0x3F) + 1;
+		if (op >= STREAM_PALETTE) {
+			n = (op & 0x0F) + 1;
+			if (len - i < 2 * n)
+				return 0;
+			for (uint8_t k = 0; k < n; ++k, i += 2)
+				palette[k] = stream_color(part + i);
+			npalette = n;
+			continue;
+		}
+		switch (op & 0xC0) {
+		case STREAM_SKIP:
+			p += n;
+			break;
+		case STREAM_RUN: {
+			if (len - i < 2)
+				return 0;
+			uint16_t c = stream_color(part + i);
+			i += 2;
+			for (; n; --n, ++p)
+				if (p < count)
+					set(p, c);
+			break;
+		}
+		case STREAM_LITERAL:
+			if (len - i < 2 * n)
+				return 0;
+			for (; n; --n, ++p, i += 2)
+				if (p < count)
+					set(p, stream_color(part + i));
+			break;
+		default: // STREAM_INDEXED
+			if (len - i < (n + 1) / 2)
+				return 0;
+			for (uint8_t k = 0; k < n; ++k, ++p) {
+				uint8_t index = k & 1 ? part[i + k / 2] & 0x0F : part[i + k / 2] >> 4;
+				if (index >= npalette)
+					return 0;
+				if (p < count)
+					set(p, palette[index]);
+			}
+			i += (n + 1) / 2;
+			break;
+		}
+	}
+	return 1;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Sending
+
+static inline uint8_t stream_index(const uint16_t* palette, uint8_t npalette, uint16_t c)
+{
+	for (uint8_t k = 0; k < npalette; ++k)
+		if (palette[k] == c)
+			return k;
+	return 0xFF;
+}
+
+// pixel i is as the receivers have it
+static inline uint8_t stream_same(const uint16_t* prev, const uint16_t* next, uint8_t i)
+{
+	return prev && next[i] == prev[i];
+}
+
+// ops from pixel *first on into out[o..max), with the palette if there is
+// one; moves *first on and returns the length. The colours of the plain
+// literals go into literals[], up to STREAM_PALETTE_MAX + 1 different ones.
+static inline uint8_t stream_ops(const uint16_t* prev, const uint16_t* next, uint8_t count,
+	uint8_t* first, uint8_t* out, uint8_t o, uint8_t max,
+	const uint16_t* palette, uint8_t npalette, uint16_t* literals, uint8_t* nliterals)
+{
+	uint8_t i = *first;
+	while (i < count) {
+		uint8_t n = 1;
+		if (stream_same(prev, next, i)) {
+			while (i + n < count && n < STREAM_OP_MAX && stream_same(prev, next, i + n))
+				++n;
+			if (i + n == count) {
+				i = count; // nothing changes from here on
+				break;
+			}
+			if (max - o < 1)
+				break;
+			out[o++] = STREAM_SKIP | (n - 1);
+			i += n;
+			continue;
+		}
+		while (i + n < count && n < STREAM_OP_MAX && next[i + n] == next[i])
+			++n;
+		if (n > 1) {
+			if (max - o < 3)
+				break;
+			out[o++] = STREAM_RUN | (n - 1);
+			out[o++] = next[i];
+			out[o++] = next[i] >> 8;
+			i += n;
+			continue;
+		}
+		// a literal, up to a run or two unchanged pixels, indexed as far as
+		// its colours are in the palette
+		uint8_t indexed = stream_index(palette, npalette, next[i]) != 0xFF;
+		while (i + n < count && n < (indexed ? STREAM_INDEXED_MAX : STREAM_OP_MAX)) {
+			uint8_t j = i + n;
+			if (j + 1 < count && next[j + 1] == next[j])
+				break;
+			if (stream_same(prev, next, j) && (j + 1 == count || stream_same(prev, next, j + 1)))
+				break;
+			if ((stream_index(palette, npalette, next[j]) != 0xFF) != indexed)
+				break;
+			++n;
+		}
+		uint8_t room = max - o < 1 ? 0 : indexed ? (max - o - 1) * 2 : (max - o - 1) / 2;
+		if (n > room)
+			n = room;
+		if (n == 0)
+			break;
+		if (indexed) {
+			out[o++] = STREAM_INDEXED | (n - 1);
+			for (uint8_t k = 0; k < n; k += 2) {
+				uint8_t hi = stream_index(palette, npalette, next[i + k]);
+				uint8_t lo = k + 1 < n ? stream_index(palette, npalette, next[i + k + 1]) : 0;
+				out[o++] = hi << 4 | lo;
+			}
+		}
+		else {
+			out[o++] = STREAM_LITERAL | (n - 1);
+			for (uint8_t k = 0; k < n; ++k) {
+				uint16_t c = next[i + k];
+				out[o++] = c;
+				out[o++] = c >> 8;
+				if (*nliterals <= STREAM_PALETTE_MAX &&
+					stream_index(literals, *nliterals, c) == 0xFF)
+					literals[(*nliterals)++] = c;
+			}
+		}
+		i += n;
+	}
+	*first = i;
+	return o;
+}
+
+// the next part of frame next[], count pixels, into out[], at most max
+// (up to STREAM_PART_MAX) bytes. prev[] is the frame the receivers have, or
+// 0 for a key frame. Starts at pixel *first, 0 for a new frame, and moves it
+// on; the frame is done when it reaches count. Returns the part's length.
+// max has to be at least STREAM_HEADER + 3, room for any one op.
+static inline uint8_t stream_encode(const uint16_t* prev, const uint16_t* next, uint8_t count,
+	uint8_t seq, uint8_t* first, uint8_t* out, uint8_t max)
+{
+	if (max > STREAM_PART_MAX)
+		max = STREAM_PART_MAX;
+	uint16_t literals[STREAM_PALETTE_MAX + 1];
+	uint8_t nliterals = 0;
+	uint8_t start = *first;
+	uint8_t len = stream_ops(prev, next, count, first, out, STREAM_HEADER, max,
+		0, 0, literals, &nliterals);
+
+	// again with the plain literals' colours as the palette, if there are
+	// few enough of them, kept if it gets further or as far in fewer bytes
+	if (nliterals > 0 && nliterals <= STREAM_PALETTE_MAX && max >= STREAM_HEADER + 1 + 2 * nliterals) {
+		uint8_t trial[STREAM_PART_MAX];
+		uint8_t o = STREAM_HEADER;
+		trial[o++] = STREAM_PALETTE | (nliterals - 1);
+		for (uint8_t k = 0; k < nliterals; ++k) {
+			trial[o++] = literals[k];
+			trial[o++] = literals[k] >> 8;
+		}
+		uint16_t unused[STREAM_PALETTE_MAX + 1];
+		uint8_t nunused = STREAM_PALETTE_MAX + 1;
+		uint8_t at = start;
+		uint8_t tlen = stream_ops(prev, next, count, &at, trial, o, max,
+			literals, nliterals, unused, &nunused);
+		if (at > *first || (at == *first && tlen < len)) {
+			for (uint8_t k = STREAM_HEADER; k < tlen; ++k)
+				out[k] = trial[k];
+			len = tlen;
+			*first = at;
+		}
+	}
+
+	out[0] = seq;
+	out[1] = start;
+	out[2] = *first >= count ? STREAM_LAST : 0;
+	return len;
+}
+
+#endif
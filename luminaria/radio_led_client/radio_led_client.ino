@@ -7,6 +7,9 @@
 #include <util/parity.h>
 #include <avr/eeprom.h>
 #include <avr/pgmspace.h>
+#include <WireflyColor.h>
+#include <WireflyStream.h>
+#include <WireflyRandom.h>
 
 // comment out below before compiling production codez!
 #define DEBUG 1
@@ -41,6 +44,7 @@ static RF12Config config;
 static char cmd;
 static byte value, stack[RF12_MAXDATA], top, sendLen, dest, quiet;
 static byte databuffer[RF12_MAXDATA], testCounter;
+static byte fb_report; // print the strip counters every second, see fb_tally()
 
 static void addCh (char* msg, char c) {
     byte n = strlen(msg);
@@ -141,9 +145,28 @@ typedef struct {
     byte data[RF12_MAXDATA];
 } FlashEntry;
 
-static FlashPage dfBuf;     // for data not yet written to flash
-static word dfLastPage;     // page number last written
-static byte dfFill;         // next byte available in buffer to store entries
+// The log is double buffered: entries go into dfBuf[dfCur] while the other
+// buffer, once full, is programmed into flash by df_poll(), DF_CHUNK bytes
+// at a time with interrupts off for each, and the CRC worked out as it goes.
+// df_poll() never waits for the flash, it just returns while it is busy;
+// it also erases the block after the one being filled, in the background,
+// once the first page of a block is in. An entry that finds both buffers
+// full is dropped and counted in dfLost, so logging can stay on during a
+// show; 'd' prints the counters.
+
+#define DF_CHUNK    32      // bytes programmed at a time
+#define DF_NONE     0xFFFF  // no erase due
+
+static FlashPage dfBuf[2];  // one fills, the other is programmed
+static byte dfCur;          // the one filling
+static byte dfFill;         // next byte available in it to store entries
+static word dfLastPage;     // page number last written, or being written
+static byte dfPending;      // dfBuf[!dfCur] is full, not yet all in flash
+static word dfChunk;        // offset of its next chunk to program
+static word dfCrc;          // of its chunks so far
+static word dfErase = DF_NONE; // block to erase next
+static byte dfErasing;      // an erase is under way
+static word dfLost, dfPages, dfErases; // entries dropped, pages and blocks done
 
 static byte df_present () {
     return dfLastPage != 0;
@@ -195,6 +218,17 @@ static void df_writeCmd (byte cmd) {
     df_command(cmd);
 }
 
+// true while the flash is programming or erasing; doesn't wait
+static byte df_busy () {
+    cli();
+    df_enable();
+    df_xfer(0x05); // Read Status Register
+    byte status = df_xfer(0);
+    df_disable();
+    sei();
+    return status != 0xFF && (status & 1);
+}
+
 void df_read (word block, word off, void* buf, word len) {
     df_command(0x03); // Read Array (Low Frequency)
     df_xfer(block >> 8);
@@ -205,13 +239,14 @@ void df_read (word block, word off, void* buf, word len) {
     df_deselect();
 }
 
-void df_write (word block, const void* buf) {
+// program len bytes from off into the page; returns before the flash is done
+void df_write (word block, byte off, const void* buf, byte len) {
     df_writeCmd(0x02); // Byte/Page Program
     df_xfer(block >> 8);
     df_xfer(block);
-    df_xfer(0);
-    for (word i = 0; i < 256; ++i)
-        df_xfer(((const byte*) buf)[(byte) i]);
+    df_xfer(off);
+    for (byte i = 0; i < len; ++i)
+        df_xfer(((const byte*) buf)[i]);
     df_deselect();
 }
 
@@ -228,15 +263,20 @@ static void df_wipe () {
     df_flush();
 }
 
-static void df_erase (word block) {
-    Serial.print("DF E ");
-    Serial.println(block);
-    
+// start erasing the block; returns before the flash is done
+static void df_eraseStart (word block) {
     df_writeCmd(DF_PAGE_ERASE); // Block Erase
     df_xfer(block >> 8);
     df_xfer(block);
     df_xfer(0);
     df_deselect();
+}
+
+static void df_erase (word block) {
+    Serial.print("DF E ");
+    Serial.println(block);
+    
+    df_eraseStart(block);
     df_flush();
 }
 
@@ -244,72 +284,115 @@ static word df_wrap (word page) {
     return page < DF_LOG_LIMIT ? page : DF_LOG_BEGIN;
 }
 
-static void df_saveBuf () {
-    if (dfFill == 0)
-        return;
-
+// hand the filled buffer to df_poll() and go on with the other one; 0 if
+// that one is still being programmed
+static byte df_swap () {
+    if (dfPending)
+        return 0;
+    FlashPage* full = &dfBuf[dfCur];
+    // set remainder of buffer data to 0xFF
+    memset(full->data + dfFill, 0xFF, sizeof full->data - dfFill);
     dfLastPage = df_wrap(dfLastPage + 1);
     if (dfLastPage == DF_LOG_BEGIN)
-        ++dfBuf.seqnum; // bump to next seqnum when wrapping
-    
-    // set remainder of buffer data to 0xFF and calculate crc over entire buffer
-    dfBuf.crc = ~0;
-    for (byte i = 0; i < sizeof dfBuf - 2; ++i) {
-        if (dfFill <= i && i < sizeof dfBuf.data)
-            dfBuf.data[i] = 0xFF;
-        dfBuf.crc = _crc16_update(dfBuf.crc, dfBuf.data[i]);
-    }
-    
-    df_write(dfLastPage, &dfBuf);
+        ++full->seqnum; // bump to next seqnum when wrapping
+    dfChunk = 0;
+    dfPending = 1;
+    dfCur ^= 1;
+    dfBuf[dfCur].seqnum = full->seqnum;
     dfFill = 0;
-    
-    // wait for write to finish before reporting page, seqnum, and time stamp
-    df_flush();
+    return 1;
+}
+
+// move the log along in flash, a chunk or an erase at a time, if the flash
+// isn't busy; call it often
+static void df_poll () {
+    if (!df_present() || df_busy())
+        return;
+    if (dfErasing) {
+        dfErasing = 0;
+        ++dfErases;
+    }
+    if (dfErase != DF_NONE) {
+        df_eraseStart(dfErase);
+        dfErase = DF_NONE;
+        dfErasing = 1;
+        return;
+    }
+    if (!dfPending)
+        return;
+
+    // crc over the page, less the crc itself, which goes out in the last chunk
+    FlashPage* full = &dfBuf[!dfCur];
+    const byte* page = (const byte*) full;
+    if (dfChunk == 0)
+        dfCrc = ~0;
+    for (word i = dfChunk; i < dfChunk + DF_CHUNK && i < sizeof *full - 2; ++i)
+        dfCrc = _crc16_update(dfCrc, page[i]);
+    if (dfChunk + DF_CHUNK == sizeof *full)
+        full->crc = dfCrc;
+    df_write(dfLastPage, dfChunk, page + dfChunk, DF_CHUNK);
+    dfChunk += DF_CHUNK;
+    if (dfChunk < sizeof *full)
+        return;
+
+    dfPending = 0;
+    ++dfPages;
+#ifdef DEBUG
     Serial.print("DF S ");
     Serial.print(dfLastPage);
     Serial.print(' ');
-    Serial.print(dfBuf.seqnum);
+    Serial.print(full->seqnum);
     Serial.print(' ');
-    Serial.println(dfBuf.timestamp);
-    
+    Serial.println(full->timestamp);
+#endif
     // erase next block if we just saved data into a fresh block
-    // at this point in time dfBuf is empty, so a lengthy erase cycle is ok
     if (dfLastPage % DF_BLOCK_SIZE == 0)
-        df_erase(df_wrap(dfLastPage + DF_BLOCK_SIZE));
+        dfErase = df_wrap(dfLastPage + DF_BLOCK_SIZE);
+}
+
+// wait until everything handed to df_poll() is in flash
+static void df_sync () {
+    while (df_present() && (dfPending || dfErase != DF_NONE || dfErasing))
+        df_poll();
 }
 
 static void df_append (const void* buf, byte len) {
-    //FIXME the current logic can't append incoming packets during a save!
+    if (!df_present() || 1 + len > sizeof dfBuf[0].data)
+        return;
+    FlashPage* page = &dfBuf[dfCur];
 
     // fill in page time stamp when appending to a fresh page
     if (dfFill == 0)
-        dfBuf.timestamp = now();
+        page->timestamp = now();
     
-    long offset = now() - dfBuf.timestamp;
-    if (offset >= 255 || dfFill + 1 + len > sizeof dfBuf.data) {
-        df_saveBuf();
-
-        dfBuf.timestamp = now();
+    long offset = now() - page->timestamp;
+    if (offset >= 255 || dfFill + 1 + len > sizeof page->data) {
+        if (!df_swap()) {
+            ++dfLost; // both buffers full, the flash is behind
+            return;
+        }
+        page = &dfBuf[dfCur];
+        page->timestamp = now();
         offset = 0;
     }
 
     // append new entry to flash buffer
-    dfBuf.data[dfFill++] = offset;
-    memcpy(dfBuf.data + dfFill, buf, len);
+    page->data[dfFill++] = offset;
+    memcpy(page->data + dfFill, buf, len);
     dfFill += len;
 }
 
 // go through entire log buffer to figure out which page was last saved
 static void scanForLastSave () {
-    dfBuf.seqnum = 0;
+    dfBuf[dfCur].seqnum = 0;
     dfLastPage = DF_LOG_LIMIT - 1;
     // look for last page before an empty page
     for (word page = DF_LOG_BEGIN; page < DF_LOG_LIMIT; ++page) {
         word currseq;
-        df_read(page, sizeof dfBuf.data, &currseq, sizeof currseq);
+        df_read(page, sizeof dfBuf[0].data, &currseq, sizeof currseq);
         if (currseq != 0xFFFF) {
             dfLastPage = page;
-            dfBuf.seqnum = currseq + 1;
+            dfBuf[dfCur].seqnum = currseq + 1;
         } else if (dfLastPage == page - 1)
             break; // careful with empty-filled-empty case, i.e. after wrap
     }
@@ -334,10 +417,9 @@ static void df_initialize () {
         Serial.print("DF I ");
         Serial.print(dfLastPage);
         Serial.print(' ');
-        Serial.println(dfBuf.seqnum);
+        Serial.println(dfBuf[dfCur].seqnum);
     
         // df_wipe();
-        df_saveBuf(); //XXX
     }
 }
 
@@ -353,12 +435,13 @@ static void df_dump () {
     word crc; 
   } 
   curr;
+  df_sync();
   discardInput();
   for (word page = DF_LOG_BEGIN; page < DF_LOG_LIMIT; ++page) {
     if (Serial.read() >= 0)
       break;
     // read marker from page in flash
-    df_read(page, sizeof dfBuf.data, &curr, sizeof curr);
+    df_read(page, sizeof dfBuf[0].data, &curr, sizeof curr);
     if (curr.seqnum == 0xFFFF)
       continue; // page never written to
     Serial.print(" df# ");
@@ -370,6 +453,13 @@ static void df_dump () {
     Serial.print(' ');
     Serial.println(curr.crc);
   }
+  Serial.print("DF L ");
+  Serial.print(dfLost);
+  Serial.print(" lost, ");
+  Serial.print(dfPages);
+  Serial.print(" pages, ");
+  Serial.print(dfErases);
+  Serial.println(" erases");
 }
 
 static word scanForMarker (word seqnum, long asof) {
@@ -383,7 +473,7 @@ static word scanForMarker (word seqnum, long asof) {
   // go through all the pages in log area of flash
   for (word page = DF_LOG_BEGIN; page < DF_LOG_LIMIT; ++page) {
     // read seqnum and timestamp from page in flash
-    df_read(page, sizeof dfBuf.data, &curr, sizeof curr);
+    df_read(page, sizeof dfBuf[0].data, &curr, sizeof curr);
     if (curr.seqnum == 0xFFFF)
       continue; // page never written to
     if (curr.seqnum >= seqnum && curr.seqnum < last.seqnum) {
@@ -397,24 +487,27 @@ static word scanForMarker (word seqnum, long asof) {
 }
 
 static void df_replay (word seqnum, long asof) {
+    // pages are read into the buffer that isn't filling, once it's in flash
+    df_sync();
+    FlashPage* buf = &dfBuf[!dfCur];
     word page = scanForMarker(seqnum, asof);
     Serial.print("r: page ");
     Serial.print(page);
     Serial.print(' ');
     Serial.println(dfLastPage);
     discardInput();
-    word savedSeqnum = dfBuf.seqnum;
+    word savedSeqnum = dfBuf[dfCur].seqnum;
     while (page != dfLastPage) {
         if (Serial.read() >= 0)
             break;
         page = df_wrap(page + 1);
-        df_read(page, 0, &dfBuf, sizeof dfBuf); // overwrites ram buffer!
-        if (dfBuf.seqnum == 0xFFFF)
+        df_read(page, 0, buf, sizeof *buf);
+        if (buf->seqnum == 0xFFFF)
             continue; // page never written to
         // skip and report bad pages
         word crc = ~0;
-        for (word i = 0; i < sizeof dfBuf; ++i)
-            crc = _crc16_update(crc, dfBuf.data[i]);
+        for (word i = 0; i < sizeof *buf; ++i)
+            crc = _crc16_update(crc, ((const byte*) buf)[i]);
         if (crc != 0) {
             Serial.print("DF C? ");
             Serial.print(page);
@@ -424,19 +517,19 @@ static void df_replay (word seqnum, long asof) {
         }
         // report each entry as "R seqnum time <data...>"
         byte i = 0;
-        while (i < sizeof dfBuf.data && dfBuf.data[i] < 255) {
+        while (i < sizeof buf->data && buf->data[i] < 255) {
             if (Serial.available())
                 break;
             Serial.print("R ");
-            Serial.print(dfBuf.seqnum);
+            Serial.print(buf->seqnum);
             Serial.print(' ');
-            Serial.print(dfBuf.timestamp + dfBuf.data[i++]);
+            Serial.print(buf->timestamp + buf->data[i++]);
             Serial.print(' ');
-            Serial.print((int) dfBuf.data[i++]);
-            byte n = dfBuf.data[i++];
+            Serial.print((int) buf->data[i++]);
+            byte n = buf->data[i++];
             while (n-- > 0) {
                 Serial.print(' ');
-                Serial.print((int) dfBuf.data[i++]);
+                Serial.print((int) buf->data[i++]);
             }
             Serial.println();
         }
@@ -444,16 +537,15 @@ static void df_replay (word seqnum, long asof) {
         Serial.print("DF R ");
         Serial.print(page);
         Serial.print(' ');
-        Serial.print(dfBuf.seqnum);
+        Serial.print(buf->seqnum);
         Serial.print(' ');
-        Serial.println(dfBuf.timestamp);
+        Serial.println(buf->timestamp);
     }
-    dfFill = 0; // ram buffer is no longer valid
-    dfBuf.seqnum = savedSeqnum + 1; // so next replay will start at a new value
+    dfBuf[dfCur].seqnum = savedSeqnum + 1; // so next replay will start at a new value
     Serial.print("DF E ");
     Serial.print(dfLastPage);
     Serial.print(' ');
-    Serial.print(dfBuf.seqnum);
+    Serial.print(dfBuf[dfCur].seqnum);
     Serial.print(' ');
     Serial.println(millis());
 }
@@ -462,6 +554,8 @@ static void df_replay (word seqnum, long asof) {
 
 #define df_present() 0
 #define df_initialize()
+#define df_append(buf, len)
+#define df_poll()
 #define df_dump()
 #define df_replay(x,y)
 #define df_erase(x)
@@ -495,6 +589,10 @@ char helpText1[] PROGMEM =
     "  ...,<nn> s - send data packet to node <nn>, no ack" "\n"
     "  <n> l      - turn activity LED on PB1 on or off" "\n"
     "  <n> q      - set quiet mode (1 = don't report bad packets)" "\n"
+    "  <n> v      - report strip shows and bytes a second (1 = on)" "\n"
+    "  u          - time the colour wheel, table against divide" "\n"
+    "  x          - time the patterns' random numbers" "\n"
+    "  d          - dump log markers, entries lost, pages written" "\n"
 ;
 
 static void showString (PGM_P s) {
@@ -571,9 +669,20 @@ static void handleSerialInput (char c) {
             case 'q': // turn quiet mode on or off (don't report bad packets)
                 quiet = value;
                 break;
+            case 'v': // report strip shows and bytes a second (off = 0, on = 1)
+                fb_report = value;
+                break;
+            case 'u': // time the colour wheel
+                wheelBench();
+                break;
+            case 'x': // time the patterns' random numbers
+                randomBench();
+                break;
+            case 'd': // dump all log markers, and the logger's counters
+                df_dump();
+                break;
             case 'f': // send FS20 command: <hchi>,<hclo>,<addr>,<cmd>f
             case 'k': // send KAKU command: <addr>,<dev>,<on>k
-            case 'd': // dump all log markers
             case 'r': // replay from specified seqnum/time marker
             case 'e': // erase specified 4Kb block
             case 'w': // wipe entire flash memory
@@ -584,9 +693,6 @@ static void handleSerialInput (char c) {
             case 'n':
             case 'o':
             case 'p':
-            case 'u':
-            case 'v':
-            case 'x':
             case 'y':
             default:
                 showHelp();
@@ -647,8 +753,7 @@ static void handleSerialInput (char c) {
 //#define DEBOUNCE_TIME       0.3  
 //#define SAMPLE_FREQUENCY    5
 //#define MAXIMUM             (DEBOUNCE_TIME * SAMPLE_FREQUENCY)
-#define MAXIMUM         4
-#define MAXIMUM_C       2
+#define MAXIMUM         4   // 40 ms at INPUT_SAMPLE_HZ
 
 //unsigned int input;       /* 0 or 1 depending on the input signal */ 
 static unsigned int integrator[3];  /* Will range from 0 to the specified MAXIMUM */
@@ -656,11 +761,11 @@ static unsigned int integrator[3];  /* Will range from 0 to the specified MAXIMU
 static unsigned int output[3];      /* Cleaned-up version of the input signal */
 
 static unsigned int maximum[3] = {
-  4,4,2}; 
+  MAXIMUM,MAXIMUM,MAXIMUM}; 
 
 unsigned int debounce(uint8_t input, char button) {
 
-  // determine which button, a, b or c.
+  // determine which button, a, b or c (the toggle switch).
   if( button < 97 || button > 99 )
     return 0;
   int i = button-97; // 0, 1, 2
@@ -715,6 +820,82 @@ static int switchT = 14; // analog 0 or AI01
 
 // Timer 1 is also used by the strip to send pixel clocks
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Inputs
+// Timer 2 samples the buttons and the toggle switch INPUT_SAMPLE_HZ times a
+// second and runs them through debounce(); nothing in the patterns samples
+// them. The switch is kept as its debounced state, input_switch. Button
+// presses become events in a small queue, and handleInputs() takes one a
+// call, at frame boundaries. A button is an event when it's let go, unless
+// the other one was held down with it: that is INPUT_BOTH, sent as the second
+// one goes down, and the releases after it are not events.
+
+#define INPUT_SAMPLE_HZ  100
+#define INPUT_QUEUE      4   // a power of 2
+
+#define INPUT_NONE  0
+#define INPUT_A     1
+#define INPUT_B     2
+#define INPUT_BOTH  3
+
+static volatile byte input_queue[INPUT_QUEUE];
+static volatile byte input_head, input_tail;
+static volatile byte input_switch;  // debounced, 1 = on
+static byte input_held, input_chord; // for the timer only
+
+static void input_push(byte event) {
+  byte next = (input_head + 1) & (INPUT_QUEUE - 1);
+  if( next == input_tail )
+    return; // full, drop it
+  input_queue[input_head] = event;
+  input_head = next;
+}
+
+// the next button event, or INPUT_NONE
+static byte input_next() {
+  if( input_tail == input_head )
+    return INPUT_NONE;
+  byte event = input_queue[input_tail];
+  input_tail = (input_tail + 1) & (INPUT_QUEUE - 1);
+  return event;
+}
+
+ISR(TIMER2_COMPA_vect) {
+  // all inputs are pulled up, low is on
+  debounce(!digitalRead(buttonA), 'a');
+  debounce(!digitalRead(buttonB), 'b');
+  debounce(!digitalRead(switchT), 'c');
+
+  byte held = output[0] | output[1] << 1;
+  byte released = input_held & ~held;
+  if( held == 3 && input_held != 3 ) {
+    input_chord = 1;
+    input_push(INPUT_BOTH);
+  }
+  if( released && !input_chord )
+    input_push(released == 1 ? INPUT_A : INPUT_B);
+  if( !held )
+    input_chord = 0;
+  input_held = held;
+  input_switch = output[2];
+}
+
+// timer 2 in CTC mode, clk/1024
+static void inputs_begin() {
+  pinMode(switchT, INPUT);
+  pinMode(buttonA, INPUT);
+  pinMode(buttonB, INPUT);
+  // set pull-up resisters on AVR
+  digitalWrite(switchT, HIGH);
+  digitalWrite(buttonA, HIGH);
+  digitalWrite(buttonB, HIGH);
+
+  TCCR2A = _BV(WGM21);
+  TCCR2B = _BV(CS22) | _BV(CS21) | _BV(CS20);
+  OCR2A = F_CPU / 1024 / INPUT_SAMPLE_HZ - 1;
+  TIMSK2 = _BV(OCIE2A);
+}
+
 #define PATTERN_OFF		0
 #define PATTERN_TWINKLE		1
 #define PATTERN_FIREFLY         2
@@ -748,14 +929,16 @@ static int switchT = 14; // analog 0 or AI01
 
 static uint8_t pattern = 0;
 static int autonomous = 0;
-static int inputA = 0;
-static int inputB = 0;
-static int inputC = 0;
 static int stopChooseAnother = 0;
 static unsigned long wait = 50;
 static int patternAvailable = 0;
 
+// pixels on the strip, up to 255: the streamed frames number them with a
+// byte. Each takes 2 bytes of RAM in fb[] and 2 in the LPD6803 library.
 #define PIX_COUNT		30
+#if PIX_COUNT > 255
+#error "PIX_COUNT is at most 255"
+#endif
 #define RF12_BUFFER_SIZE	66
 
 static uint8_t my_data[RF12_BUFFER_SIZE];
@@ -773,17 +956,128 @@ static LPD6803 strip = LPD6803(PIX_COUNT, dataPin, clockPin);
 
 #define FRONT_PIXEL(X) (X <= PIXEL_FRONT_LAST)
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Framebuffer
+// Patterns draw into fb[] with fb_set() and end a frame with fb_show(). A
+// pixel is only marked dirty when its colour changes, so writing it twice in
+// a frame, or clearing one that is already dark, costs nothing. fb_show()
+// copies the dirty pixels of the dirty run into the strip and has it clocked
+// out once, or not at all if nothing changed. The LPD6803s are one long shift
+// register, so every push clocks the whole strip, FB_FRAME_BYTES; pushes are
+// at least FB_FRAME_MS apart. fb_show() never waits for that: a frame drawn
+// sooner stays dirty, later drawing goes on top of it, and fb_flush(), from
+// handleInputs(), pushes it once the time is up.
+// The 'v' command prints the pushes and bytes of each second.
+
+#define FB_FRAME_MS     20
+#define FB_FRAME_BYTES  (4 + 2 * PIX_COUNT) // 32 start bits, 16 a pixel
+
+typedef struct {
+  word shows;    // frames pushed to the strip
+  word skipped;  // fb_show() with nothing changed
+  word bytes;    // clocked out
+} FbCounters;
+
+static uint16_t fb[PIX_COUNT];
+static uint8_t fb_dirty[(PIX_COUNT + 7) / 8]; // one bit a pixel
+static uint8_t fb_lo = PIX_COUNT, fb_hi;  // dirty pixels are in [fb_lo, fb_hi)
+static unsigned long fb_shownAt;
+static FbCounters fb_count, fb_second;    // this second so far, the last one
+static unsigned long fb_secondAt;
+
+static void fb_set(uint8_t p, uint16_t c) {
+  if( p >= PIX_COUNT || fb[p] == c )
+    return;
+  fb[p] = c;
+  fb_dirty[p >> 3] |= 1 << (p & 7);
+  if( p < fb_lo )
+    fb_lo = p;
+  if( p >= fb_hi )
+    fb_hi = p+1;
+}
+
+static uint16_t fb_get(uint8_t p) {
+  return fb[p];
+}
+
+// roll the counters over once a second
+static void fb_tally() {
+  unsigned long t = millis();
+  if( t - fb_secondAt < 1000 )
+    return;
+  fb_secondAt = t;
+  fb_second = fb_count;
+  memset(&fb_count, 0, sizeof fb_count);
+#ifdef DEBUG
+  if( fb_report ) {
+    Serial.print("fb ");
+    Serial.print(fb_second.shows);
+    Serial.print(" shows ");
+    Serial.print(fb_second.skipped);
+    Serial.print(" skipped ");
+    Serial.print(fb_second.bytes);
+    Serial.println(" bytes/s");
+  }
+#endif
+}
+
+// push the dirty pixels, if it is time for another frame or if forced
+static void fb_flush(byte force = 0) {
+  if( fb_lo >= fb_hi || (!force && millis() - fb_shownAt < FB_FRAME_MS) )
+    return;
+  fb_shownAt = millis();
+  for( uint8_t p=fb_lo; p<fb_hi; p++ )
+    if( fb_dirty[p >> 3] & (1 << (p & 7)) )
+      strip.setPixelColor(p, fb[p]);
+  memset(fb_dirty, 0, sizeof fb_dirty);
+  fb_lo = PIX_COUNT;
+  fb_hi = 0;
+  strip.show();
+  fb_count.shows++;
+  fb_count.bytes += FB_FRAME_BYTES;
+}
+
+// end a frame: push it now, or as soon as fb_flush() may; returns 0 if
+// nothing changed
+static int fb_show() {
+  fb_tally();
+  if( fb_lo >= fb_hi ) {
+    fb_count.skipped++;
+    return 0;
+  }
+  fb_flush();
+  return 1;
+}
+
+// delay() for the patterns, pushing a frame fb_show() left when its time comes
+static void fb_delay(unsigned long ms) {
+  unsigned long t0 = millis();
+  do
+    fb_flush();
+  while( millis() - t0 < ms );
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Random numbers
+// One generator for all the patterns, see WireflyRandom.h, seeded once in
+// setup() from the node id and AIO1. AIO1 is switchT, pulled up, so there
+// is little noise on it and the node id does most of the work. Coin flips
+// and 5-bit colours come out of rand_bits(), a draw giving 32 bits. The 'x'
+// command times a frame's draws against Arduino's random().
+
+static rand_state rng;
+
 // No color value, clear LEDs
 void off(byte opts = 0) {
   int startIndex = (IGNORE_FRONT(opts)?PIXEL_FRONT_LAST+1:0);
   int endIndex = (IGNORE_BACK(opts)?PIXEL_FRONT_LAST+1:strip.numPixels());
   for(uint8_t p=startIndex; p<endIndex; p++) {
-    debounceInputs();
-    strip.setPixelColor(p,0);
+    fb_set(p,0);
   }
-  strip.show();
-  delay(wait);
-  debounceInputs();
+  // already dark: nothing to push, and nothing to wait for
+  if( !fb_show() )
+    return;
+  fb_delay(wait);
 }
 
 void FireFly(byte opts = 0){
@@ -792,27 +1086,25 @@ void FireFly(byte opts = 0){
   long EnabledStatus; // one bit flag for each LED 1 = enabled, 0 = disabled
   uint8_t c = 0;
   for (uint8_t p=0; p < strip.numPixels(); p++) {
-    debounceInputs();
-    bitWrite(FadeStatus,p, random(0,2)); //randomly set the fade in/out status for each LED
-    if (random(0,2)){//randomly set the enabled status
+    bitWrite(FadeStatus,p, rand_bit(&rng)); //randomly set the fade in/out status for each LED
+    if (rand_bit(&rng)){//randomly set the enabled status
       bitWrite(EnabledStatus,p,1);
-      c = random(0,32); // randomly set each enabled pixel to a random yellow-green brightness
-      strip.setPixelColor(p,Color(c,c,0));
+      c = rand_bits(&rng, 5); // randomly set each enabled pixel to a random yellow-green brightness
+      fb_set(p,Color(c,c,0));
     }
   }
 
   int i = 64; // adjusts probability that an LED will come back on...
   while(1){
     for (uint8_t p=0; p < strip.numPixels(); p++) {
-      debounceInputs();
       if (bitRead(EnabledStatus,p)){ //only do things if the LED is enabled
 
         //get pixel's red or green value
         //maybe use pointer to LED's 2byte color
         //and use a mask and maybe a << or >>
-        // using extern static uint16_t *pixlels from ladyada's code
+        // from our framebuffer, fb_get()
 
-        c = (uint8_t)((strip.pixelColorData(p) >> 5) & 0x001F);
+        c = color15_lo(fb_get(p)); // red is always the low field
         if (bitRead(FadeStatus,p)) { //fade in
           if (c == 31){ //it's all the way on
             c = 30;
@@ -824,7 +1116,7 @@ void FireFly(byte opts = 0){
         } 
         else { //fade out
           if (c == 0){ //all the way out
-            c = random(0,2);
+            c = rand_bit(&rng);
             bitWrite(FadeStatus,p,1);
             bitWrite(EnabledStatus,p,c); //does this LED get turned off?
           } 
@@ -832,10 +1124,10 @@ void FireFly(byte opts = 0){
             c--; //make it fade out (maybe fade out faster than fade in? closer to life like)
           }
         }
-        strip.setPixelColor(p,Color(c,c,0));
+        fb_set(p,Color(c,c,0));
       } 
       else{ //pixel not enabled
-        if (random(0,i)==1){ //randomly turn disabled LEDs on, but only do it once every cycle. adjust random max range to change probablilities
+        if (rand_below(&rng, i)==1){ //randomly turn disabled LEDs on, but only do it once every cycle. adjust random max range to change probablilities
           bitWrite(EnabledStatus,p,1);
           if (bitRead(EnabledStatus,p)){
             bitWrite(FadeStatus,p,1);
@@ -843,12 +1135,10 @@ void FireFly(byte opts = 0){
         }
       }
     }//end of for each LED loop
-    strip.show();
+    fb_show();
     if( handleInputs() )
       return;
-    debounceInputs();
-    delay(wait);
-    debounceInputs();
+    fb_delay(wait);
   }//end of while
 
 }
@@ -872,9 +1162,7 @@ void clockSync( uint16_t c = COLOR_JELLY, byte opts = 0){
 
   off(opts);
 
-  debounceInputs();
-  delay(random(0,2001)); //make sure everyone starts at a somewhat different time
-  debounceInputs();
+  fb_delay(rand_below(&rng, 2001)); //make sure everyone starts at a somewhat different time
 
   int startIndex = (IGNORE_FRONT(opts)?PIXEL_FRONT_LAST+1:0);
   int endIndex = (IGNORE_BACK(opts)?PIXEL_FRONT_LAST+1:strip.numPixels());
@@ -885,10 +1173,9 @@ void clockSync( uint16_t c = COLOR_JELLY, byte opts = 0){
     sum_ON = 0;
     //digitalWrite(A3, HIGH); //turn LED on
     for(uint8_t p=startIndex; p<endIndex; p++) {
-      debounceInputs();
-      strip.setPixelColor(p, c);
+      fb_set(p, c);
     }
-    strip.show();
+    fb_show();
     //transmit a packet
     if( rf12_canSend() ) {
       uint8_t send_data = PATTERN_CLOCKSYNC;
@@ -898,7 +1185,6 @@ void clockSync( uint16_t c = COLOR_JELLY, byte opts = 0){
     time_end = time_start + time_half_cycle + ON_longer;
 
     while(millis()<time_end){ //how far are we from the start, replace with a millis() or micros()
-      debounceInputs();
       if( rf12_recvDone() && !rf12_crc ) { //did we get a good packet?
         sum_ON += millis()-time_start;
         ON_count++;
@@ -907,17 +1193,15 @@ void clockSync( uint16_t c = COLOR_JELLY, byte opts = 0){
 
     //digitalWrite(A3, LOW); //turn LED off
     for(uint8_t p=startIndex; p<endIndex; p++) {
-      debounceInputs();
-      strip.setPixelColor(p, 0);
+      fb_set(p, 0);
     }
-    strip.show();
+    fb_show();
 
     OFF_count = 0;
     time_start = millis();
     time_end = time_start + time_half_cycle + OFF_longer;
 
     while(millis()<time_end){
-      debounceInputs();
       if (rf12_recvDone() && rf12_crc == 0){
         sum_OFF += time_end - millis(); //how far are we from the start of the next cycle
         OFF_count++;
@@ -972,14 +1256,11 @@ void RadarSweep( uint16_t c = COLOR_JELLY, byte opts = FLAG_IGNORE_LANTERN|FLAG_
   while( 1 ) {
     off(opts);    
     for(int i=0; i<36; i++) {
-      debounceInputs();
-      strip.setPixelColor(pix[i],col[i]);
-      strip.show();
+      fb_set(pix[i],col[i]);
+      fb_show();
       if( handleInputs() )
         return;
-      debounceInputs();
-      delay(wait+tim[i]);
-      debounceInputs();
+      fb_delay(wait+tim[i]);
     }
   }
 }
@@ -997,13 +1278,11 @@ void RadialWipe( uint16_t c = COLOR_JELLY, byte opts = FLAG_IGNORE_LANTERN|FLAG_
   while( 1 ) {
     for( uint16_t offon = 0; offon<=c; offon+=c ) {
       for(uint8_t i=0; i<=PIXEL_FRONT_LAST; i++) {
-        debounceInputs();
-        strip.setPixelColor(pix[i], offon);
-        strip.show();
+        fb_set(pix[i], offon);
+        fb_show();
         if( handleInputs() )
           return;
-        delay(wait+tim[i]);
-        debounceInputs();
+        fb_delay(wait+tim[i]);
       }
     }
   }
@@ -1022,20 +1301,64 @@ void VerticalWipe(uint16_t c = COLOR_JELLY, byte opts = FLAG_IGNORE_LANTERN|FLAG
   while( 1 ) {
     for( uint16_t offon = 0; offon<=c; offon+=c ) {
       for(uint8_t i=0; i<=PIXEL_FRONT_LAST; i++) {
-        debounceInputs();
-        strip.setPixelColor(pix[i],offon);
-        strip.show();
+        fb_set(pix[i],offon);
+        fb_show();
         if( handleInputs() )
           return;
-        delay(wait+tim[i]);
-        debounceInputs();
+        fb_delay(wait+tim[i]);
       }
     }
   }
 }
-void combJellies(byte opts = 0) {
-  randomSeed(analogRead(0));
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Colour wheel
+// The 96 colours of the wheel, r - g - b - back to r, packed for the strip
+// the way Color() does it, UPSIDE_DOWN_LEDS and all, by the compiler into
+// flash; wheel() is a table lookup. Spreading the wheel along the strip
+// (rainbowCycle(), combJellies()) walks a 16.16 hue accumulator instead of
+// working out p * WHEEL_SIZE / pixels for every pixel. The step is rounded
+// up, which keeps every pixel's hue the same as the division gives for
+// strips of up to 255 pixels. The 'u' command times both ways.
+
+#define WHEEL_SIZE  96
+
+#ifdef UPSIDE_DOWN_LEDS
+#define COLOR15(r,g,b)  ((uint16_t)(b) << 10 | (uint16_t)(g) << 5 | (r))
+#else
+#define COLOR15(r,g,b)  ((uint16_t)(g) << 10 | (uint16_t)(b) << 5 | (r))
+#endif
+
+#define WHEEL15(n)  ((n) < 32 ? COLOR15(31-(n), (n), 0) : \
+                     (n) < 64 ? COLOR15(0, 63-(n), (n)-32) : \
+                                COLOR15((n)-64, 0, 95-(n)))
+#define WHEEL8(n)   WHEEL15(n), WHEEL15(n+1), WHEEL15(n+2), WHEEL15(n+3), \
+                    WHEEL15(n+4), WHEEL15(n+5), WHEEL15(n+6), WHEEL15(n+7)
+
+static const uint16_t wheel_table[WHEEL_SIZE] PROGMEM = {
+  WHEEL8(0), WHEEL8(8), WHEEL8(16), WHEEL8(24), WHEEL8(32), WHEEL8(40),
+  WHEEL8(48), WHEEL8(56), WHEEL8(64), WHEEL8(72), WHEEL8(80), WHEEL8(88)
+};
+
+#define HUE_WRAP  ((uint32_t) WHEEL_SIZE << 16)
+
+// colour h of the wheel, h < WHEEL_SIZE
+static uint16_t wheel(uint8_t h) {
+  return pgm_read_word(&wheel_table[h]);
+}
+
+// hue accumulator step to go once round the wheel over pixels
+static uint32_t hue_step(uint8_t pixels) {
+  return (HUE_WRAP + pixels - 1) / pixels;
+}
+
+static uint32_t hue_next(uint32_t hue, uint32_t step) {
+  hue += step;
+  if( hue >= HUE_WRAP )
+    hue -= HUE_WRAP;
+  return hue;
+}
 
+void combJellies(byte opts = 0) {
   /// assuming numPixels() is constrained by RF12_BUFFER_SIZE !!
   int pp = strip.numPixels();
   char sequence[30] = {
@@ -1044,24 +1367,20 @@ void combJellies(byte opts = 0) {
   memcpy(sequence_data,sequence,pp);
 
   off(opts);
+  uint32_t step = hue_step(pp);
 
   while( 1 ) {
     //int color_size = 33;
-    for (uint16_t c=0; c<96; c++) {     // cycle all 96 colors in the wheel
+    for (uint16_t c=0; c<WHEEL_SIZE; c++) {     // cycle all 96 colors in the wheel
+      // each pixel a fraction i / pp of the way round the wheel, plus c
+      uint32_t hue = (uint32_t) c << 16;
       for (uint8_t i=0; i<pp; i++) {
-        debounceInputs();
         // have pixels independently cycle through color wheel
-        uint8_t p = sequence_data[i];
-        // tricky math! use each pixel as a fraction of the full 96-color wheel
-        // (thats the i / strip.numPixels() part)
-        // Then add in j which makes the colors go around per pixel
-        // the % 96 is to make the wheel cycle around
-        strip.setPixelColor(p, Wheel( ((i * 96 / strip.numPixels()) + c) % 96) );
+        fb_set(sequence_data[i], wheel(hue >> 16));
+        hue = hue_next(hue, step);
       }
-      strip.show();   // write all the pixels out
-      debounceInputs();
-      delay(wait);
-      debounceInputs();
+      fb_show();   // write all the pixels out
+      fb_delay(wait);
       if( handleInputs() )
         return;
     }
@@ -1071,15 +1390,15 @@ void combJellies(byte opts = 0) {
 void rainbow(byte opts = 0) {
 
   while( 1 ) {
-    for(uint16_t c=0; c < 96; c++) {     // cycle all 96 colors in the wheel
+    for(uint16_t c=0; c < WHEEL_SIZE; c++) {     // cycle all 96 colors in the wheel
+      uint8_t h = c;
       for (uint8_t p=0; p < strip.numPixels(); p++) {
-        debounceInputs();
-        strip.setPixelColor(p, Wheel( (p + c) % 96));
+        fb_set(p, wheel(h));
+        if( ++h == WHEEL_SIZE )
+          h = 0;
       }
-      strip.show();   // write all the pixels out
-      debounceInputs();
-      delay(wait);
-      debounceInputs();
+      fb_show();   // write all the pixels out
+      fb_delay(wait);
       if( handleInputs() )
         return;
     }
@@ -1089,21 +1408,19 @@ void rainbow(byte opts = 0) {
 // Slightly different, this one makes the rainbow wheel equally distributed 
 // along the chain
 void rainbowCycle(byte opts = 0) {
+  uint32_t step = hue_step(strip.numPixels());
 
   while( 1 ) {
-    for (uint16_t c=0; c < 96; c++) {     // cycle all 96 colors in the wheel
+    for (uint16_t c=0; c < WHEEL_SIZE; c++) {     // cycle all 96 colors in the wheel
+      // each pixel a fraction p / numPixels() of the way round the wheel,
+      // plus c; see hue_step()
+      uint32_t hue = (uint32_t) c << 16;
       for (uint8_t p=0; p < strip.numPixels(); p++) {
-        debounceInputs();
-        // tricky math! we use each pixel as a fraction of the full 96-color wheel
-        // (thats the i / strip.numPixels() part)
-        // Then add in j which makes the colors go around per pixel
-        // the % 96 is to make the wheel cycle around
-        strip.setPixelColor(p, Wheel( ((p * 96 / strip.numPixels()) + c) % 96) );
+        fb_set(p, wheel(hue >> 16));
+        hue = hue_next(hue, step);
       }  
-      strip.show();   // write all the pixels out
-      debounceInputs();
-      delay(wait);
-      debounceInputs();
+      fb_show();   // write all the pixels out
+      fb_delay(wait);
       if( handleInputs() )
         return;
     }
@@ -1114,13 +1431,10 @@ void rainbowCycle(byte opts = 0) {
 // fill the dots all at same time with said color
 void colorDoubleBuffer16(uint16_t c, byte opts = 0) {
   for( uint8_t p=0; p < strip.numPixels(); p++) {
-    debounceInputs();
-    strip.setPixelColor(p, c);
+    fb_set(p, c);
   }
-  strip.show();
-  debounceInputs();
-  delay(wait);
-  debounceInputs();
+  fb_show();
+  fb_delay(wait);
 }
 
 // only turn on the specified LED
@@ -1129,26 +1443,21 @@ void modeSelect(uint8_t modeValue) {
     modeValue = 1;
   if( modeValue > PATTERN_LAST )
     modeValue = PATTERN_LAST;
-  strip.setPixelColor(modeValue-1, COLOR_JELLY);
-  strip.show();
-  debounceInputs();
-  delay(wait);
-  debounceInputs();
+  fb_set(modeValue-1, COLOR_JELLY);
+  fb_show();
+  fb_delay(wait);
 }
 
 void identify( uint16_t c = COLOR_JELLY ) {
   uint8_t nodeid = (config.nodeId & 0x1F);
   for( uint8_t p=0; p < strip.numPixels(); p++) {
-    debounceInputs();
     if( p < nodeid )
-      strip.setPixelColor(p,c);
+      fb_set(p,c);
     else
-      strip.setPixelColor(p,0);
+      fb_set(p,0);
   }
-  strip.show();
-  debounceInputs();
-  delay(wait);
-  debounceInputs();
+  fb_show();
+  fb_delay(wait);
 }
 
 // fill the dots all at same time with said color
@@ -1165,35 +1474,28 @@ void colorDoubleBuffer8(uint8_t *data, byte opts = 0) {
 void morseCode(char *buffer, byte opts = 0) {
   //blink out morse code for given message on the lantern
   for(char *c = buffer; *c>='a' && *c<='z'; c++) {
-    debounceInputs();
     switch(*c) {
     case 'o':
       // dah dah dah
       colorDoubleBuffer16(COLOR_LANTERN,opts);
-      delay(wait+700);
-      debounceInputs();
+      fb_delay(wait+700);
       off(opts);
       colorDoubleBuffer16(COLOR_LANTERN,opts);
-      delay(wait+700);
-      debounceInputs();
+      fb_delay(wait+700);
       off(opts);
       colorDoubleBuffer16(COLOR_LANTERN,opts);
-      delay(wait+700);
-      debounceInputs();
+      fb_delay(wait+700);
       break;
     case 's':
       // dit dit dit
       colorDoubleBuffer16(COLOR_LANTERN,opts);
-      delay(wait+200);
-      debounceInputs();
+      fb_delay(wait+200);
       off(opts);
       colorDoubleBuffer16(COLOR_LANTERN,opts);
-      delay(wait+200);
-      debounceInputs();
+      fb_delay(wait+200);
       off(opts);
       colorDoubleBuffer16(COLOR_LANTERN,opts);
-      delay(wait+200);
-      debounceInputs();
+      fb_delay(wait+200);
       break;
     }
     off(opts);
@@ -1207,25 +1509,21 @@ void sos() {
 
 
 
-void adHoc(uint8_t *data, byte opts = 0) {
-  //adHoc iterates through the received payload combining 2 bytes to make a "Color"
-  //the sender must send each pixel's "Color" as 2 bytes, which get recombined in this function
+static stream_state adhoc_stream;
 
-  // here's the trick -- incoming buffer (data) is a contiguous memory block of 60 bytes.
-  // we will use a pointer to two-byte data type called uint16_t to treat the buffer as
-  // a contiguous block of 30 two-byte ints. This also causes the array notation [i] to increment
-  // through the array correctly as a two-byte int. Use reinterpret_cast only when you are absolutely
-  // sure its okay to do so, else bad buffer overflows and data corruption can occur.
-  uint16_t *color_ptr = reinterpret_cast<uint16_t*>(data); // point to elements in buffer as a two-byte int
-
-  for (uint8_t p=0; p < strip.numPixels(); p++) { //need to iterate through each pixel
-    debounceInputs();
-    strip.setPixelColor(p, color_ptr[p]); //set the appropriate pixel to our "Color"
-  }
-  strip.show();
-  debounceInputs();
-  delay(wait);
-  debounceInputs();
+// one part of a streamed frame, see WireflyStream.h: decoded straight from
+// the packet into the framebuffer, and shown when the frame is complete.
+// The pushes are forced, at the sender's pace rather than FB_FRAME_MS, so a
+// deferred frame never has the next one's first part merged into it.
+void adHoc(const uint8_t *part, uint8_t len) {
+  byte what = stream_part(&adhoc_stream, part, len);
+  if( what & STREAM_DROP )
+    return;
+  if( what & STREAM_FLUSH )
+    fb_flush(1); // the last frame's last part never came, show what did
+  stream_decode(part, len, fb_set, PIX_COUNT);
+  if( what & STREAM_SHOW )
+    fb_flush(1);
 }
 
 // fill the dots one after the other with said color
@@ -1234,12 +1532,9 @@ void colorWipe(uint16_t c, byte opts = 1) {
   while(1) {
     for( uint16_t offon = 0; offon<=c; offon+=c ) {
       for( uint8_t p=0; p < strip.numPixels(); p++) {
-        debounceInputs();
-        strip.setPixelColor(p, offon);
-        strip.show();
-        debounceInputs();
-        delay(wait);
-        debounceInputs();
+        fb_set(p, offon);
+        fb_show();
+        fb_delay(wait);
 
         if( handleInputs() )
           return;
@@ -1251,41 +1546,33 @@ void colorWipe(uint16_t c, byte opts = 1) {
 void fireworks(byte opts = 0) {
   uint8_t randRed,randGreen,randBlue,lucky;
   off(true);
-  randomSeed(analogRead(0));
   while( !handleInputs() ) {
-    debounceInputs();
-    lucky = random(0,strip.numPixels());
+    lucky = rand_below(&rng, strip.numPixels());
     if(LANTERN(lucky))
       continue;
-    randRed = random(0,32);
-    randGreen = random(0,32);
-    randBlue = random(0,32);
+    randRed = rand_bits(&rng, 5);
+    randGreen = rand_bits(&rng, 5);
+    randBlue = rand_bits(&rng, 5);
     off(opts);
-    strip.setPixelColor(lucky,Color(randRed,randGreen,randBlue));
-    strip.show();
-    debounceInputs();
-    delay(wait);
-    debounceInputs();
+    fb_set(lucky,Color(randRed,randGreen,randBlue));
+    fb_show();
+    fb_delay(wait);
   }
 }
 
 static void stains(byte opts = 0) {
   uint8_t randRed,randGreen,randBlue,lucky;
-  randomSeed(analogRead(0));
   off();
   while( !handleInputs() ) {
-    debounceInputs();
-    lucky = random(0,strip.numPixels());
+    lucky = rand_below(&rng, strip.numPixels());
     if( !IGNORE_LANTERN(opts) && LANTERN(lucky) )
       continue; 
-    randRed = random(0,32);
-    randGreen = random(0,32);
-    randBlue = random(0,32);
-    strip.setPixelColor(lucky,Color(randRed,randGreen,randBlue));
-    strip.show();
-    debounceInputs();
-    delay(wait);
-    debounceInputs();
+    randRed = rand_bits(&rng, 5);
+    randGreen = rand_bits(&rng, 5);
+    randBlue = rand_bits(&rng, 5);
+    fb_set(lucky,Color(randRed,randGreen,randBlue));
+    fb_show();
+    fb_delay(wait);
   }
 }
 
@@ -1304,52 +1591,44 @@ static void twinkle(uint8_t maxOn, uint8_t maxSwap, byte opts = 0) {
 
   uint8_t rpix = 0;
 
-  randomSeed(analogRead(0));
   memset(my_data, 0, sizeof(my_data));
 
   // clear all pixels
   off(opts);
 
   // setup initial on/off state
-  strip.setPixelColor(PIXEL_LANTERN, COLOR_LANTERN);
+  fb_set(PIXEL_LANTERN, COLOR_LANTERN);
   for( uint8_t i=0; i<maxOn; i++) {
     do {
-      debounceInputs();
-      rpix = (uint8_t)random(randStart,randEnd);
+      rpix = (uint8_t)rand_range(&rng, randStart, randEnd);
     } 
     while( !IGNORE_LANTERN(opts) && LANTERN(rpix) );
-    strip.setPixelColor(rpix, Color(31,31,31));
+    fb_set(rpix, Color(31,31,31));
     my_data[i] = rpix; // store 'on' pixel for later swap out
   }
-  strip.show();
-  debounceInputs();
-  delay(wait);
-  debounceInputs();
+  fb_show();
+  fb_delay(wait);
 
   // repeatedly swap out at most maxSwap pixels from being in the 'on' state
   while( !handleInputs() ) {
     for( uint8_t i=0; i<maxSwap; i++) {
-      debounceInputs();
 
       // turn off a random pixel
-      uint8_t temp = (uint8_t)random(0,maxOn);
-      strip.setPixelColor(my_data[temp], 0);
+      uint8_t temp = (uint8_t)rand_below(&rng, maxOn);
+      fb_set(my_data[temp], 0);
 
       // turn on a random pixel
       do {
-        debounceInputs();
-        rpix = (uint8_t)random(randStart,randEnd);
+        rpix = (uint8_t)rand_range(&rng, randStart, randEnd);
       } 
       while( !IGNORE_LANTERN(opts) && LANTERN(rpix) );
-      uint16_t color = (uint16_t)random(32000,32767);
-      strip.setPixelColor(rpix, color);
+      uint16_t color = rand_range(&rng, 32000, 32767);
+      fb_set(rpix, color);
 
       // assign new 'on' pixel
       my_data[temp] = rpix;
-      strip.show();
-      debounceInputs();
-      delay(wait);
-      debounceInputs();
+      fb_show();
+      fb_delay(wait);
     }
   }
 }
@@ -1362,14 +1641,16 @@ unsigned int Color(uint8_t r, uint8_t g, uint8_t b)
   //Take the lowest 5 bits of each value and append them end to end
 #ifdef UPSIDE_DOWN_LEDS
   //swap green and blue bits
-  return( ((unsigned int)b & 0x1F )<<10 | ((unsigned int)g & 0x1F)<<5 | (unsigned int)r & 0x1F);
+  return color15(b, g, r);
 #else
-  return( ((unsigned int)g & 0x1F )<<10 | ((unsigned int)b & 0x1F)<<5 | (unsigned int)r & 0x1F);
+  return color15(g, b, r);
 #endif
 }
 
-//Input a value 0 to 127 to get a color value.
+//Input a value 0 to 95 to get a color value.
 //The colours are a transition r - g -b - back to r
+//Worked out each time; the patterns use wheel(), this is what wheelBench()
+//checks and times it against
 unsigned int Wheel(byte WheelPos)
 {
   byte r,g,b;
@@ -1394,10 +1675,96 @@ unsigned int Wheel(byte WheelPos)
   return(Color(r,g,b));
 }
 
+// time a rainbowCycle() frame worked out with Wheel() and a divide per pixel
+// against the table and hue accumulator, and check they give the same
+// colours; the strip's interrupts keep running, so compare the two
+void wheelBench() {
+  static volatile uint16_t frame[PIX_COUNT]; // volatile, so nothing is optimized out
+  uint8_t n = strip.numPixels();
+  uint32_t step = hue_step(n);
+
+  unsigned long t0 = micros();
+  for (uint16_t c=0; c < WHEEL_SIZE; c++)
+    for (uint8_t p=0; p < n; p++)
+      frame[p] = Wheel( ((p * 96 / n) + c) % 96);
+  unsigned long t1 = micros();
+  for (uint16_t c=0; c < WHEEL_SIZE; c++) {
+    uint32_t hue = (uint32_t) c << 16;
+    for (uint8_t p=0; p < n; p++) {
+      frame[p] = wheel(hue >> 16);
+      hue = hue_next(hue, step);
+    }
+  }
+  unsigned long t2 = micros();
+
+  word differ = 0;
+  for (uint16_t c=0; c < WHEEL_SIZE; c++) {
+    uint32_t hue = (uint32_t) c << 16;
+    for (uint8_t p=0; p < n; p++) {
+      differ += Wheel( ((p * 96 / n) + c) % 96) != wheel(hue >> 16);
+      hue = hue_next(hue, step);
+    }
+  }
+
+  // cycles a pixel
+  unsigned long pixels = (unsigned long) WHEEL_SIZE * n;
+  Serial.print("wheel: divide ");
+  Serial.print((t1 - t0) * (F_CPU / 1000000) / pixels);
+  Serial.print(", table ");
+  Serial.print((t2 - t1) * (F_CPU / 1000000) / pixels);
+  Serial.print(" cycles/pixel, ");
+  Serial.print(differ);
+  Serial.println(" differ");
+}
+
+// the draws of a frame of FireFly() (a coin and a 1 in 64 chance a pixel),
+// twinkle() (10 swaps) or fireworks(), with Arduino's random() or rng
+static void randomFrame(byte pattern, uint8_t n, byte fast) {
+  static volatile uint16_t sink; // so nothing is optimized out
+  switch( pattern ) {
+  case 0:
+    for (uint8_t p=0; p < n; p++)
+      sink = fast ? rand_bit(&rng) + rand_below(&rng, 64) : random(0,2) + random(0,64);
+    break;
+  case 1:
+    for (uint8_t k=0; k < 10; k++)
+      sink = fast ? rand_below(&rng, 12) + rand_range(&rng, 0, n) + rand_range(&rng, 32000, 32767) :
+        random(0,12) + random(0,n) + random(32000,32767);
+    break;
+  default:
+    sink = fast ? rand_below(&rng, n) + rand_bits(&rng, 5) + rand_bits(&rng, 5) + rand_bits(&rng, 5) :
+      random(0,n) + random(0,32) + random(0,32) + random(0,32);
+    break;
+  }
+}
+
+// cycles a frame spends drawing random numbers, random() against rng; the
+// strip's interrupts keep running, so compare the two
+void randomBench() {
+  static const char* const names[3] = { "firefly", "twinkle", "fireworks" };
+  uint8_t n = strip.numPixels();
+  for (byte k=0; k < 3; k++) {
+    unsigned long t0 = micros();
+    for (byte f=0; f < 16; f++)
+      randomFrame(k, n, 0);
+    unsigned long t1 = micros();
+    for (byte f=0; f < 16; f++)
+      randomFrame(k, n, 1);
+    unsigned long t2 = micros();
+    Serial.print(names[k]);
+    Serial.print(": random() ");
+    Serial.print((t1 - t0) * (F_CPU / 1000000) / 16);
+    Serial.print(", rng ");
+    Serial.print((t2 - t1) * (F_CPU / 1000000) / 16);
+    Serial.println(" cycles/frame");
+  }
+}
+
 void runPattern(int patternToRun = 0) {
   activityLed(1);
 
-  if( !autonomous )
+  // ad hoc frames are decoded from rf12_data itself
+  if( !autonomous && patternToRun != PATTERN_ADHOC )
     memcpy(my_data+1, const_cast<uint8_t*>(rf12_data+1), RF12_BUFFER_SIZE-1);
 
   int same = (pattern == patternToRun);
@@ -1439,8 +1806,8 @@ void runPattern(int patternToRun = 0) {
     stains();
     break;
   case PATTERN_ADHOC:
-    if( !patternAvailable )
-      adHoc( my_data+1 ); // pass starting address of 60-byte array color data
+    if( patternAvailable && !autonomous && rf12_len > 1 )
+      adHoc( const_cast<uint8_t*>(rf12_data+1), rf12_len-1 ); // the part, after the pattern byte
     break;
   case PATTERN_PAINT:
     if( !patternAvailable )
@@ -1521,6 +1888,9 @@ int my_recvDone() {
 #endif
 
     if (rf12_crc == 0) {
+      // log it as "hdr len data..."; df_poll() gets it into flash later
+      df_append((const void*) (rf12_buf + 1), rf12_len + 2);
+
       // in radio mode, tell clock sync to piss off
       pattern = ((rf12_len>0&&rf12_data[0]!=PATTERN_CLOCKSYNC)?rf12_data[0]:pattern);
 
@@ -1538,20 +1908,6 @@ int my_recvDone() {
   return( patternAvailable );
 }
 
-void debounceInputs() {
-
-  static byte prevC = 0;
-
-  inputA = !digitalRead(buttonA);
-  inputB = !digitalRead(buttonB);
-  inputC = (debounce(inputA&inputB, 'c')?output[2]:prevC);
-  if( inputC & prevC ) 
-    inputC = 0;
-  prevC = inputC;
-  inputA = (debounce(inputA, 'a')?output[0]:0);
-  inputB = (debounce(inputB, 'b')?output[1]:0);
-}
-
 // returns 1 if captured input should trigger a break in a loop
 int handleInputs() {
 
@@ -1563,12 +1919,15 @@ int handleInputs() {
     handleSerialInput(Serial.read());
 #endif
 
-  debounceInputs();
+  fb_tally();
+  fb_flush();
+  df_poll();
+  byte event = input_next();
 
   // update autonomous value
-  if( autonomous != !digitalRead(switchT) ) {
+  if( autonomous != input_switch ) {
     trigger = 1;
-    autonomous = !digitalRead(switchT);
+    autonomous = input_switch;
     off(); // cut off lights
 #ifdef DEBUG
     if( autonomous )
@@ -1579,7 +1938,7 @@ int handleInputs() {
   }
 
   if( autonomous ) {
-    if( inputC ) {
+    if( event == INPUT_BOTH ) {
       trigger = 1;
       off();
       stopChooseAnother = !stopChooseAnother;
@@ -1600,7 +1959,7 @@ int handleInputs() {
       }
 
     } 
-    else if (inputA) {
+    else if( event == INPUT_A ) {
       if( stopChooseAnother ) {
 #ifdef DEBUG
         Serial.println("a -- cycle mode -1");
@@ -1618,7 +1977,7 @@ int handleInputs() {
         wait = (wait>0?(wait-10):50); // speed up then wrap around back to default speed
       }
     } 
-    else if (inputB) {
+    else if( event == INPUT_B ) {
       if( stopChooseAnother ) {
 #ifdef DEBUG
         Serial.println("a -- cycle mode +1");
@@ -1640,16 +1999,16 @@ int handleInputs() {
   else if( my_recvDone() && !rf12_crc ) {
     trigger = 1;
   } 
-  else if( inputC ) {
+  else if( event == INPUT_BOTH ) {
     wait = 50; // reset speed
   } 
-  else if( inputA ) {
+  else if( event == INPUT_A ) {
 #ifdef DEBUG
     Serial.println("a -- speed up!");
 #endif
     wait = (wait>0?(wait-10):50); // speed up then wrap around back to default speed
   } 
-  else if( inputB ) {
+  else if( event == INPUT_B ) {
 #ifdef DEBUG
     Serial.println("b -- flash LEDs");
 #endif
@@ -1670,13 +2029,7 @@ void setup() {
 #endif
 
   // setup on-board inputs
-  pinMode(switchT, INPUT);
-  pinMode(buttonA, INPUT);
-  pinMode(buttonB, INPUT);
-  // set pull-up resisters on AVR
-  digitalWrite(switchT, HIGH);
-  digitalWrite(buttonA, HIGH);
-  digitalWrite(buttonB, HIGH);
+  inputs_begin();
 
 
     if (rf12_config()) {
@@ -1706,6 +2059,8 @@ void setup() {
 
   df_initialize();
 
+  rand_seed(&rng, config.nodeId & RF12_HDR_MASK, rand_noise(analogRead, 0));
+
   memset(my_data,0,sizeof(my_data));
 
   patternAvailable = 0;